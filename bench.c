@@ -0,0 +1,551 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rrbt.h"
+
+/*
+Benchmarks of the core tree operations, next to the same operations on a flat
+array as the baseline. Every operation is run for a range of sizes, from 1K
+items up to the size given with `-m', and the results are written as JSON to
+the file given with `-o', or to stdout:
+
+        { "config": { "branch_bits": 5, ... },
+          "results": [ { "impl": "rrbt", "op": "push", "size": 1000,
+                         "ops": 1000, "ns_per_op": 4.1,
+                         "p50_ns": 3.9, "p90_ns": 4.4, "p99_ns": 9.8,
+                         "max_ns": 51.0 }, ... ] }
+
+Cheap operations are timed in batches of LAT_BATCH, the percentiles are then
+those of the average time per operation of a batch, as timing every single
+push or get would mostly measure the clock.
+*/
+
+#define LAT_BATCH 32
+#define RANDOM_OPS (1 << 20)
+#define REPS_BUDGET 100000000LL
+#define MIN_SIZE 1000
+#define MAX_SIZE 100000000
+
+typedef struct Bench Bench;
+
+struct Bench
+{
+    const char *impl;
+    const char *op;
+    int size;
+    long long ops;
+    long long total_ns;
+    double *samples;
+    int count;
+    int capacity;
+};
+
+FILE *bench_out;
+bool bench_first = true;
+/* Results are stored here so that the compiler keeps computing them */
+volatile long long bench_sink;
+void *volatile bench_keep;
+int *random_indices;
+
+long long
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+The number of times to repeat an operation that costs O(size), so that every
+size gets a similar amount of work, between 10 and 1000 runs.
+*/
+
+int
+reps_for(int size)
+{
+    long long reps;
+
+    reps = REPS_BUDGET / size;
+    if (reps < 10)
+        return 10;
+    if (reps > 1000)
+        return 1000;
+    return (int)reps;
+}
+
+void
+bench_begin(Bench *bench, const char *impl, const char *op, int size,
+            int capacity)
+{
+    bench->impl = impl;
+    bench->op = op;
+    bench->size = size;
+    bench->ops = 0;
+    bench->total_ns = 0;
+    bench->samples = malloc(sizeof(double) * capacity);
+    bench->count = 0;
+    bench->capacity = capacity;
+}
+
+/*
+Record that `ops' operations were run since `start'.
+*/
+
+void
+bench_sample(Bench *bench, long long start, int ops)
+{
+    long long elapsed;
+
+    elapsed = now_ns() - start;
+    bench->ops += ops;
+    bench->total_ns += elapsed;
+    if (bench->count < bench->capacity)
+        bench->samples[bench->count++] = (double)elapsed / ops;
+}
+
+int
+compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a,
+           y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+double
+percentile(const double *sorted, int count, int pct)
+{
+    return sorted[(long long)(count - 1) * pct / 100];
+}
+
+void
+bench_end(Bench *bench)
+{
+    double *s;
+    int n;
+
+    s = bench->samples;
+    n = bench->count;
+    qsort(s, n, sizeof(double), compare_doubles);
+
+    fprintf(bench_out,
+            "%s    { \"impl\": \"%s\", \"op\": \"%s\", \"size\": %d, "
+            "\"ops\": %lld, \"ns_per_op\": %.2f, "
+            "\"p50_ns\": %.2f, \"p90_ns\": %.2f, \"p99_ns\": %.2f, "
+            "\"max_ns\": %.2f }",
+            bench_first ? "" : ",\n",
+            bench->impl, bench->op, bench->size,
+            bench->ops, (double)bench->total_ns / bench->ops,
+            percentile(s, n, 50), percentile(s, n, 90),
+            percentile(s, n, 99), s[n - 1]);
+    bench_first = false;
+    fflush(bench_out);
+
+    fprintf(stderr, "%-6s %-10s %10d %10.2f ns/op\n", bench->impl, bench->op,
+            bench->size, (double)bench->total_ns / bench->ops);
+    free(bench->samples);
+}
+
+/* TREE */
+
+Tree *
+tree_push(int size)
+{
+    Bench bench;
+    Tree *tree;
+    long long start;
+    int i,
+        j;
+
+    bench_begin(&bench, "rrbt", "push", size, size / LAT_BATCH + 1);
+    tree = TreeNew();
+    for (i = 0; i < size; i = j)
+    {
+        start = now_ns();
+        for (j = i; j < i + LAT_BATCH && j < size; j++)
+            TreePush(tree, (Elem)j);
+        bench_sample(&bench, start, j - i);
+    }
+    bench_end(&bench);
+
+    return tree;
+}
+
+void
+tree_get_seq(Tree *tree, int size)
+{
+    Bench bench;
+    long long start,
+              sum;
+    int i,
+        j;
+
+    bench_begin(&bench, "rrbt", "get_seq", size, size / LAT_BATCH + 1);
+    sum = 0;
+    for (i = 0; i < size; i = j)
+    {
+        start = now_ns();
+        for (j = i; j < i + LAT_BATCH && j < size; j++)
+            sum += (long long)TreeGet(tree, j);
+        bench_sample(&bench, start, j - i);
+    }
+    bench_sink = sum;
+    bench_end(&bench);
+}
+
+void
+tree_get_random(Tree *tree, int size)
+{
+    Bench bench;
+    long long start,
+              sum;
+    int i,
+        j;
+
+    bench_begin(&bench, "rrbt", "get_random", size, RANDOM_OPS / LAT_BATCH);
+    sum = 0;
+    for (i = 0; i < RANDOM_OPS; i = j)
+    {
+        start = now_ns();
+        for (j = i; j < i + LAT_BATCH; j++)
+            sum += (long long)TreeGet(tree, random_indices[j] % size);
+        bench_sample(&bench, start, LAT_BATCH);
+    }
+    bench_sink = sum;
+    bench_end(&bench);
+}
+
+void
+tree_set(Tree *tree, int size)
+{
+    Bench bench;
+    long long start;
+    int i,
+        j;
+
+    bench_begin(&bench, "rrbt", "set", size, RANDOM_OPS / LAT_BATCH);
+    for (i = 0; i < RANDOM_OPS; i = j)
+    {
+        start = now_ns();
+        for (j = i; j < i + LAT_BATCH; j++)
+            TreeSet(tree, random_indices[j] % size, (Elem)j);
+        bench_sample(&bench, start, LAT_BATCH);
+    }
+    bench_end(&bench);
+}
+
+void
+tree_iter(Tree *tree, int size)
+{
+    Bench bench;
+    TreeIter iter;
+    const Elem *items;
+    long long start,
+              sum;
+    int reps,
+        length,
+        r,
+        i;
+
+    reps = reps_for(size);
+    bench_begin(&bench, "rrbt", "iter", size, reps);
+    sum = 0;
+    for (r = 0; r < reps; r++)
+    {
+        start = now_ns();
+        TreeIterInit(&iter, tree);
+        while (TreeIterNext(&iter, &items, &length))
+            for (i = 0; i < length; i++)
+                sum += (long long)items[i];
+        bench_sample(&bench, start, size);
+    }
+    bench_sink = sum;
+    bench_end(&bench);
+}
+
+/*
+Concatenating a tree with itself shares all of its nodes but the seam, as
+concatenating two independent trees would.
+*/
+
+void
+tree_concat(Tree *tree, int size)
+{
+    Bench bench;
+    Tree *ret;
+    long long start;
+    int reps,
+        r;
+
+    reps = reps_for(size);
+    bench_begin(&bench, "rrbt", "concat", size, reps);
+    for (r = 0; r < reps; r++)
+    {
+        start = now_ns();
+        ret = TreeConcat(tree, tree);
+        bench_sample(&bench, start, 1);
+        TreeRelease(ret);
+    }
+    bench_end(&bench);
+}
+
+void
+tree_slice(Tree *tree, int size)
+{
+    Bench bench;
+    Tree *ret;
+    long long start;
+    int reps,
+        from,
+        to,
+        r;
+
+    reps = reps_for(size);
+    bench_begin(&bench, "rrbt", "slice", size, reps);
+    for (r = 0; r < reps; r++)
+    {
+        from = random_indices[2 * r] % size;
+        to = random_indices[2 * r + 1] % size;
+        if (from > to)
+        {
+            int swap = from;
+            from = to;
+            to = swap;
+        }
+
+        start = now_ns();
+        ret = TreeSlice(tree, from, to + 1);
+        bench_sample(&bench, start, 1);
+        TreeRelease(ret);
+    }
+    bench_end(&bench);
+}
+
+void
+bench_tree(int size)
+{
+    Tree *tree;
+
+    tree = tree_push(size);
+    tree_get_seq(tree, size);
+    tree_get_random(tree, size);
+    tree_set(tree, size);
+    tree_iter(tree, size);
+    tree_concat(tree, size);
+    tree_slice(tree, size);
+    TreeRelease(tree);
+}
+
+/* ARRAY */
+
+/*
+The baseline is a plain array of items, grown by doubling like a std::vector,
+where slicing and concatenating copy the items.
+*/
+
+typedef struct Array Array;
+
+struct Array
+{
+    Elem *items;
+    int length;
+    int capacity;
+};
+
+void
+array_push(Array *arr, Elem value)
+{
+    if (arr->length == arr->capacity)
+    {
+        arr->capacity = arr->capacity ? 2 * arr->capacity : 16;
+        arr->items = realloc(arr->items, sizeof(Elem) * arr->capacity);
+    }
+    arr->items[arr->length++] = value;
+}
+
+void
+bench_array(int size)
+{
+    Bench bench;
+    Array arr;
+    Elem *copy;
+    long long start,
+              sum;
+    int reps,
+        from,
+        to,
+        r,
+        i,
+        j;
+
+    bench_begin(&bench, "array", "push", size, size / LAT_BATCH + 1);
+    memset(&arr, 0, sizeof(Array));
+    for (i = 0; i < size; i = j)
+    {
+        start = now_ns();
+        for (j = i; j < i + LAT_BATCH && j < size; j++)
+            array_push(&arr, (Elem)j);
+        bench_sample(&bench, start, j - i);
+    }
+    bench_end(&bench);
+
+    bench_begin(&bench, "array", "get_seq", size, size / LAT_BATCH + 1);
+    sum = 0;
+    for (i = 0; i < size; i = j)
+    {
+        start = now_ns();
+        for (j = i; j < i + LAT_BATCH && j < size; j++)
+            sum += (long long)arr.items[j];
+        bench_sample(&bench, start, j - i);
+    }
+    bench_sink = sum;
+    bench_end(&bench);
+
+    bench_begin(&bench, "array", "get_random", size, RANDOM_OPS / LAT_BATCH);
+    sum = 0;
+    for (i = 0; i < RANDOM_OPS; i = j)
+    {
+        start = now_ns();
+        for (j = i; j < i + LAT_BATCH; j++)
+            sum += (long long)arr.items[random_indices[j] % size];
+        bench_sample(&bench, start, LAT_BATCH);
+    }
+    bench_sink = sum;
+    bench_end(&bench);
+
+    bench_begin(&bench, "array", "set", size, RANDOM_OPS / LAT_BATCH);
+    for (i = 0; i < RANDOM_OPS; i = j)
+    {
+        start = now_ns();
+        for (j = i; j < i + LAT_BATCH; j++)
+            arr.items[random_indices[j] % size] = (Elem)j;
+        bench_sample(&bench, start, LAT_BATCH);
+    }
+    bench_end(&bench);
+
+    reps = reps_for(size);
+    bench_begin(&bench, "array", "iter", size, reps);
+    sum = 0;
+    for (r = 0; r < reps; r++)
+    {
+        start = now_ns();
+        for (i = 0; i < size; i++)
+            sum += (long long)arr.items[i];
+        bench_sample(&bench, start, size);
+    }
+    bench_sink = sum;
+    bench_end(&bench);
+
+    bench_begin(&bench, "array", "concat", size, reps);
+    for (r = 0; r < reps; r++)
+    {
+        start = now_ns();
+        copy = malloc(sizeof(Elem) * 2 * (size_t)size);
+        memcpy(copy, arr.items, sizeof(Elem) * size);
+        memcpy(copy + size, arr.items, sizeof(Elem) * size);
+        bench_keep = copy;
+        bench_sample(&bench, start, 1);
+        free(copy);
+    }
+    bench_end(&bench);
+
+    bench_begin(&bench, "array", "slice", size, reps);
+    for (r = 0; r < reps; r++)
+    {
+        from = random_indices[2 * r] % size;
+        to = random_indices[2 * r + 1] % size;
+        if (from > to)
+        {
+            int swap = from;
+            from = to;
+            to = swap;
+        }
+
+        start = now_ns();
+        copy = malloc(sizeof(Elem) * (to + 1 - from));
+        memcpy(copy, arr.items + from, sizeof(Elem) * (to + 1 - from));
+        bench_keep = copy;
+        bench_sample(&bench, start, 1);
+        free(copy);
+    }
+    bench_end(&bench);
+
+    free(arr.items);
+}
+
+/* MAIN */
+
+void
+usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-m max_size] [-o results.json]\n", name);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned int state;
+    long long max_size;
+    int size,
+        i;
+
+    max_size = MAX_SIZE;
+    bench_out = stdout;
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+            max_size = atoll(argv[++i]);
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+        {
+            bench_out = fopen(argv[++i], "w");
+            if (bench_out == NULL)
+            {
+                perror(argv[i]);
+                return 1;
+            }
+        }
+        else
+            usage(argv[0]);
+    }
+    if (max_size < MIN_SIZE || max_size > MAX_SIZE)
+    {
+        fprintf(stderr, "max_size must be between %d and %d\n",
+                MIN_SIZE, MAX_SIZE);
+        return 1;
+    }
+
+    /* xorshift, so that every run reads the same indices */
+    random_indices = malloc(sizeof(int) * RANDOM_OPS);
+    state = 2463534242u;
+    for (i = 0; i < RANDOM_OPS; i++)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        random_indices[i] = (int)(state & 0x7fffffff);
+    }
+
+    fprintf(bench_out,
+            "{ \"config\": { \"branch_bits\": %d, \"leaf_factor\": %d, "
+            "\"elem_size\": %d, \"lat_batch\": %d },\n"
+            "  \"results\": [\n",
+            BRANCH_BITS, LEAF_FACTOR, (int)sizeof(Elem), LAT_BATCH);
+    for (size = MIN_SIZE; size <= max_size; size *= 10)
+    {
+        bench_tree(size);
+        bench_array(size);
+    }
+    fprintf(bench_out, "\n  ] }\n");
+
+    if (bench_out != stdout)
+        fclose(bench_out);
+    free(random_indices);
+
+    return 0;
+}
@@ -0,0 +1,69 @@
+#include <stdio.h>
+
+#include "rrbt.h"
+
+int primes[] = {  2,   3,   5,   7,  11,  13,  17,  19,  23,  29,
+                 31,  37,  41,  43,  47,  53,  59,  61,  67,  71,
+                 73,  79,  83,  89,  97, 101, 103, 107, 109, 113,
+                127, 131, 137, 139, 149, 151, 157, 163, 167, 173,
+                179, 181, 191, 193, 197, 199, 211, 223, 227, 229,
+                233, 239, 241, 251, 257, 263, 269, 271, 277, 281,
+                283, 293, 307, 311, 313, 317, 331, 337, 347, 349,
+                353, 359, 367, 373, 379, 383, 389, 397, 401, 409,
+                419, 421, 431, 433, 439, 443, 449, 457, 461, 463,
+                467, 479, 487, 491, 499, 503, 509, 521, 523, 541};
+
+int
+main()
+{
+    Tree *tree_1, *tree_2, *tree_result;
+    Branch *branch_1, *branch_2;
+    bool ok;
+    int i;
+
+    branch_1 =
+    BranchFromLeafArr((Leaf *[]){
+        LeafFromArr((Elem[]){1, 2, 3, 4}, 4),
+        LeafFromArr((Elem[]){5, 6}, 2),
+    }, 2);
+
+    branch_2 =
+    BranchFromLeafArr((Leaf *[]){ 
+        LeafFromArr((Elem[]){7, 8, 9}, 3),
+        LeafFromArr((Elem[]){10, 11}, 2),
+        LeafFromArr((Elem[]){12, 13}, 2),
+        LeafFromArr((Elem[]){14, 15, 16}, 3),
+    }, 4);
+
+    tree_1 = TreeNew();
+    tree_1->length = 6;
+    tree_1->height = 1;
+    tree_1->root = branch_1;
+    TreePrint(tree_1);
+    printf("\n\n");
+
+    tree_2 = TreeNew();
+    tree_2->length = 10;
+    tree_2->height = 1;
+    tree_2->root = branch_2;
+    TreePrint(tree_2);
+    printf("\n\n");
+
+    tree_result = TreeConcat(tree_1, tree_2);
+    TreePrint(tree_result);
+    printf("\n");
+
+    /* The fixtures hold 1 to 16 in order, which the result has to keep */
+    ok = tree_result->length == 16;
+    for (i = 0; ok && i < 16; i++)
+        ok = TreeGet(tree_result, i) == i + 1;
+    if (!ok)
+        printf("concatenation lost the order of the items\n");
+
+    TreeRelease(tree_result);
+    TreeRelease(tree_2);
+    TreeRelease(tree_1);
+
+    return ok ? 0 : 1;
+}
+
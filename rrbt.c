@@ -1,16 +1,61 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <stddef.h>
+#include <pthread.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rrbt.h"
 
-#define BRANCH_FACTOR 4
-#define SHIFT_BITS 2
-#define SHIFT_MASK 0b11
+#define SHIFT_BITS BRANCH_BITS
+#define SHIFT_MASK (BRANCH_FACTOR - 1)
 #define AVG_COMPACT 1
 
-typedef struct Tree Tree;
-typedef struct Branch Branch;
-typedef struct Leaf Leaf;
+#ifdef __GNUC__
+#define PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define PREFETCH(addr) ((void)(addr))
+#endif
+
+/*
+Building with `-DSIMD_SEARCH' searches the size tables of relaxed branches
+with SSE2 or AVX2 on x86, whichever the CPU running the program supports. It
+pays off for badly relaxed trees only, the slot of an index is rarely more
+than a step past its radix slot once concatenation has rebalanced the tree.
+*/
+
+#if defined(SIMD_SEARCH) && defined(__GNUC__) \
+    && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+/*
+Nodes are reference counted, as they can be shared between any number of
+trees. The counts are updated atomically so that trees sharing nodes can be
+used and released from different threads, building with `-DNONATOMIC_REFS'
+trades that for plain increments when trees never cross threads.
+*/
+
+#ifdef NONATOMIC_REFS
+#define REFS_LOAD(refs) (refs)
+#define REFS_INC(refs) (++(refs))
+#define REFS_DEC(refs) (--(refs))
+#else
+#define REFS_LOAD(refs) __atomic_load_n(&(refs), __ATOMIC_ACQUIRE)
+#define REFS_INC(refs) __atomic_add_fetch(&(refs), 1, __ATOMIC_RELAXED)
+#define REFS_DEC(refs) __atomic_sub_fetch(&(refs), 1, __ATOMIC_ACQ_REL)
+#endif
+
 typedef struct branch_pair branch_pair;
 
 struct branch_pair
@@ -19,54 +64,530 @@ struct branch_pair
     Branch *right;
 };
 
-struct Tree
+branch_pair BranchHighConcat(Branch **branches, int num_nodes, int height);
+branch_pair BranchLowConcat(Leaf **leafs, int num_nodes);
+void merge_branches(Branch **src, int src_len, int to_remove, Branch **ret,
+                    int height);
+
+
+/* ALLOC */
+
+/*
+Nodes and trees are allocated through `Allocator's. The allocator used by the
+calling thread can be switched with AllocatorUse, which returns the previous
+one, so that a block of code can build its trees with a different allocator.
+
+The slab and arena allocators carve nodes out of blocks aligned to SLAB_SIZE,
+which start with the allocator they belong to, so whichever of the two is in
+use, a node is given back to the one it came from. An allocator of one's own
+carries no such tag, its nodes have to be released while it is in use, and
+only its nodes may be released while it is.
+
+The default is `SlabAllocator', which carves nodes out of slabs, one size
+class per node type, so that nodes allocated one after the other (say, the
+leafs of a tree being built) end up next to each other in memory. Every
+thread keeps the nodes it freed on a free list of its own, which the next
+allocation of the same size takes from, so threads rarely contend. A list
+growing past two slabs' worth of nodes hands one slab's worth back to the
+slabs they came from, under a lock, and the allocations of a thread whose
+list ran empty take them from there before carving a new slab. Nodes freed
+by another thread than the one allocating them thus come back into use, and
+a slab whose nodes all came back is returned to the system. A thread that
+exits hands all of its nodes back.
+
+An arena on the other hand never frees a single node, ArenaFree drops every
+tree and node allocated from it at once, without walking them. Trees living in
+an arena must not share nodes with trees living outside of it.
+*/
+
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_CLASS_SIZE 16
+#define SLAB_CLASSES 64
+
+typedef struct node_block node_block;
+typedef struct slab_head slab_head;
+typedef struct slab_class slab_class;
+typedef struct arena_chunk arena_chunk;
+typedef struct Arena Arena;
+
+struct node_block
 {
-    int length;
-    int height;
-    void *root;
+    Allocator *allocator;
 };
 
-Tree *TreeNew(void);
-void  TreeHeighten(Tree *tree);
-void  TreePush(Tree *tree, int value);
- int  TreeGet(Tree *tree, int index);
-void  TreeSet(Tree *tree, int index, int value);
-Tree *TreeConcat(Tree *left, Tree *right);
+/*
+The header of a slab, its nodes follow from SLAB_HEADER on. `free_list'
+holds those of them handed back, and the slab is on the list of its class
+while it has any.
+*/
 
-struct Branch
+struct slab_head
 {
-    int length;
-    int size_table[BRANCH_FACTOR];
-    void *slots[BRANCH_FACTOR];
+    node_block block;
+    slab_head *prev;
+    slab_head *next;
+    void *free_list;
+    int free;
+    int capacity;
 };
 
-Branch *BranchNew(void);
-  bool  BranchPush(Branch *branch, int height, int value);
-   int  BranchGet(Branch *branch, int height, int index);
-  void  BranchSet(Branch *branch, int height, int index, int value);
-  bool  BranchPushNode(Branch *parent, void *child, int child_len);
+/* The nodes start on a cache line, so that branches of a line fill one */
+#define SLAB_HEADER \
+    ((sizeof(slab_head) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE)
 
-branch_pair BranchHighConcat(Branch *left, Branch *right);
-branch_pair BranchLowConcat(Branch *left, Branch *right);
+struct slab_class
+{
+    void *free_list;
+    int count;
+    char *next;
+    char *end;
+};
 
-struct Leaf
+struct arena_chunk
 {
-    int length;
-    int slots[BRANCH_FACTOR];
+    node_block block;
+    arena_chunk *prev;
+    char *next;
+    char *end;
+};
+
+struct Arena
+{
+    Allocator allocator;
+    arena_chunk *chunk;
 };
 
-Leaf *LeafNew(void);
-bool  LeafPush(Leaf *leaf, int value);  
- int  LeafGet(Leaf *leaf, int index);
-void  LeafSet(Leaf *leaf, int index, int value);
-void  LeafPushArray(Leaf *leaf, int arr_len, int *arr);
+static __thread slab_class slab_classes[SLAB_CLASSES];
+static slab_head *slab_lists[SLAB_CLASSES];
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slab_key;
+
+int
+slab_class_of(size_t size)
+{
+    return (size + SLAB_CLASS_SIZE - 1) / SLAB_CLASS_SIZE;
+}
+
+node_block *
+block_of(void *ptr)
+{
+    return (node_block *)((size_t)ptr & ~(size_t)(SLAB_SIZE - 1));
+}
+
+size_t
+block_size(size_t size)
+{
+    return (size + SLAB_SIZE - 1) & ~(size_t)(SLAB_SIZE - 1);
+}
+
+/*
+Map a block of `size' bytes, rounded up by block_size. The system places the
+mappings next to each other, so that a tree spread over many blocks is spread
+over little more memory than it takes. A mapping that is not aligned is made
+again a SLAB_SIZE larger, and cut down to the highest aligned block in it,
+which leaves the next mapping aligned as well.
+*/
+
+void *
+block_new(Allocator *allocator, size_t size)
+{
+    node_block *block;
+    char *ptr,
+         *start;
+
+    size = block_size(size);
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr != MAP_FAILED && (size_t)ptr & (SLAB_SIZE - 1))
+    {
+        munmap(ptr, size);
+        ptr = mmap(NULL, size + SLAB_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr != MAP_FAILED)
+        {
+            start = (char *)(((size_t)ptr + SLAB_SIZE)
+                             & ~(size_t)(SLAB_SIZE - 1));
+            munmap(ptr, start - ptr);
+            munmap(start + size, ptr + SLAB_SIZE - start);
+            ptr = start;
+        }
+    }
+    if (ptr == MAP_FAILED)
+        abort();
+
+    block = (node_block *)ptr;
+    block->allocator = allocator;
+
+    return block;
+}
+
+void
+block_free(void *block, size_t size)
+{
+    munmap(block, block_size(size));
+}
+
+/*
+The nodes a slab of `class' holds, which is as many as a thread hands back
+at once.
+*/
+
+int
+slab_capacity(int class)
+{
+    return (SLAB_SIZE - SLAB_HEADER) / (class * SLAB_CLASS_SIZE);
+}
+
+void
+slab_list_remove(slab_head *slab, int class)
+{
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        slab_lists[class] = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+}
+
+/*
+Hand `count' nodes of the free list of the calling thread back to their
+slabs. A slab all of whose nodes are back is returned to the system.
+*/
+
+void
+slab_flush(int class, int count)
+{
+    slab_class *cache;
+    slab_head *slab;
+    void *ptr;
+
+    cache = &slab_classes[class];
+    pthread_mutex_lock(&slab_lock);
+    while (count-- > 0)
+    {
+        ptr = cache->free_list;
+        cache->free_list = *(void **)ptr;
+        cache->count--;
+
+        slab = (slab_head *)block_of(ptr);
+        *(void **)ptr = slab->free_list;
+        slab->free_list = ptr;
+        if (slab->free++ == 0)
+        {
+            slab->prev = NULL;
+            slab->next = slab_lists[class];
+            if (slab->next)
+                slab->next->prev = slab;
+            slab_lists[class] = slab;
+        }
+        if (slab->free == slab->capacity)
+        {
+            slab_list_remove(slab, class);
+            block_free(slab, SLAB_SIZE);
+        }
+    }
+    pthread_mutex_unlock(&slab_lock);
+}
+
+/*
+Hand everything the exiting thread holds back to the slabs: the nodes on its
+free lists, and those of the slabs it was carving it had not got to, so that
+the threads of a pool that is freed do not take their slabs with them.
+*/
+
+void
+slab_thread_exit(void *classes)
+{
+    slab_class *cache;
+    int class;
+
+    (void)classes;
+    for (class = 1; class < SLAB_CLASSES; class++)
+    {
+        cache = &slab_classes[class];
+        for (; cache->next < cache->end;
+             cache->next += class * SLAB_CLASS_SIZE)
+        {
+            *(void **)cache->next = cache->free_list;
+            cache->free_list = cache->next;
+            cache->count++;
+        }
+        slab_flush(class, cache->count);
+    }
+}
+
+void
+slab_key_new(void)
+{
+    pthread_key_create(&slab_key, slab_thread_exit);
+}
+
+/*
+Take up to a slab's worth of nodes from the slabs of `class' onto the free
+list of the calling thread, or start carving a new slab if none has any.
+*/
+
+void
+slab_refill(int class)
+{
+    slab_class *cache;
+    slab_head *slab;
+    void *ptr;
+    int capacity;
+
+    pthread_once(&slab_once, slab_key_new);
+    if (pthread_getspecific(slab_key) == NULL)
+        pthread_setspecific(slab_key, slab_classes);
+
+    cache = &slab_classes[class];
+    capacity = slab_capacity(class);
+    pthread_mutex_lock(&slab_lock);
+    while (cache->count < capacity && (slab = slab_lists[class]))
+    {
+        while (cache->count < capacity && slab->free_list)
+        {
+            ptr = slab->free_list;
+            slab->free_list = *(void **)ptr;
+            slab->free--;
+            *(void **)ptr = cache->free_list;
+            cache->free_list = ptr;
+            cache->count++;
+        }
+        if (slab->free_list == NULL)
+            slab_list_remove(slab, class);
+    }
+    pthread_mutex_unlock(&slab_lock);
+    if (cache->count)
+        return;
+
+    slab = block_new(&SlabAllocator, SLAB_SIZE);
+    slab->prev = slab->next = NULL;
+    slab->free_list = NULL;
+    slab->free = 0;
+    slab->capacity = capacity;
+    cache->next = (char *)slab + SLAB_HEADER;
+    cache->end = cache->next + (size_t)capacity * class * SLAB_CLASS_SIZE;
+}
+
+/*
+Nodes too large for a slab get a block of their own.
+*/
+
+void *
+slab_alloc(Allocator *allocator, size_t size)
+{
+    slab_class *cache;
+    void *ptr;
+    int class;
+
+    (void)allocator;
+    class = slab_class_of(size);
+    if (class >= SLAB_CLASSES)
+        return (char *)block_new(&SlabAllocator, SLAB_HEADER + size)
+               + SLAB_HEADER;
+
+    cache = &slab_classes[class];
+    if (cache->free_list == NULL && cache->next == cache->end)
+        slab_refill(class);
+    if (cache->free_list)
+    {   /* Reuse a previously freed node */
+        ptr = cache->free_list;
+        cache->free_list = *(void **)ptr;
+        cache->count--;
+        return ptr;
+    }
+
+    ptr = cache->next;
+    cache->next += class * SLAB_CLASS_SIZE;
+
+    return ptr;
+}
+
+void
+slab_free(Allocator *allocator, void *ptr, size_t size)
+{
+    Allocator *owner;
+    slab_class *cache;
+    int class;
+
+    owner = block_of(ptr)->allocator;
+    if (owner != allocator)
+    {   /* A node of an arena */
+        owner->free(owner, ptr, size);
+        return;
+    }
+
+    class = slab_class_of(size);
+    if (class >= SLAB_CLASSES)
+    {
+        block_free(block_of(ptr), SLAB_HEADER + size);
+        return;
+    }
+
+    cache = &slab_classes[class];
+    *(void **)ptr = cache->free_list;
+    cache->free_list = ptr;
+    if (++cache->count * class * SLAB_CLASS_SIZE >= 2 * SLAB_SIZE)
+        slab_flush(class, slab_capacity(class));
+}
+
+Allocator SlabAllocator = { slab_alloc, slab_free };
+
+static __thread Allocator *node_allocator = &SlabAllocator;
+
+Allocator *
+AllocatorUse(Allocator *allocator)
+{
+    Allocator *prev;
+
+    prev = node_allocator;
+    node_allocator = allocator;
+
+    return prev;
+}
+
+void *
+node_alloc(size_t size)
+{
+    void *ptr;
+
+    ptr = node_allocator->alloc(node_allocator, size);
+    memset(ptr, 0, size);
+
+    return ptr;
+}
+
+void
+node_free(void *ptr, size_t size)
+{
+    node_allocator->free(node_allocator, ptr, size);
+}
+
+/*
+A chunk holding an allocation larger than SLAB_SIZE holds nothing else, so
+that every allocation starts within SLAB_SIZE of its chunk.
+*/
+
+void *
+arena_alloc(Allocator *allocator, size_t size)
+{
+    Arena *arena;
+    arena_chunk *chunk;
+    void *ptr;
+
+    arena = (Arena *)allocator;
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    chunk = arena->chunk;
+    if (chunk == NULL || chunk->next + size > chunk->end)
+    {
+        size_t chunk_size;
+
+        chunk_size = sizeof(arena_chunk) + size;
+        if (chunk_size < SLAB_SIZE)
+            chunk_size = SLAB_SIZE;
+        chunk = block_new(allocator, chunk_size);
+        chunk->prev = arena->chunk;
+        chunk->next = (char *)(chunk + 1);
+        chunk->end = (char *)chunk + chunk_size;
+        arena->chunk = chunk;
+    }
+    ptr = chunk->next;
+    chunk->next += size;
+
+    return ptr;
+}
+
+void
+arena_free(Allocator *allocator, void *ptr, size_t size)
+{
+    Allocator *owner;
+
+    /* Everything is freed at once by ArenaFree, other blocks go back now */
+    owner = block_of(ptr)->allocator;
+    if (owner != allocator)
+        owner->free(owner, ptr, size);
+}
+
+Allocator *
+ArenaNew(void)
+{
+    Arena *arena;
+
+    arena = calloc(1, sizeof(Arena));
+    arena->allocator.alloc = arena_alloc;
+    arena->allocator.free = arena_free;
+
+    return &arena->allocator;
+}
+
+void
+ArenaFree(Allocator *allocator)
+{
+    Arena *arena;
+    arena_chunk *chunk;
+
+    arena = (Arena *)allocator;
+    while ((chunk = arena->chunk))
+    {
+        arena->chunk = chunk->prev;
+        block_free(chunk, chunk->end - (char *)chunk);
+    }
+    free(arena);
+}
 
 /* UTIL */
 
+/*
+The number of index bits below a branch of `height', i.e. a child of the
+branch holds up to 1 << level_shift(height) items.
+*/
+
+int
+level_shift(int height)
+{
+    return LEAF_BITS + SHIFT_BITS * (height - 1);
+}
+
 int
 shift_index(int index, int shift_by)
 {
-    return (index >> (SHIFT_BITS * shift_by)) & SHIFT_MASK;
+    int shift;
+
+    shift = level_shift(shift_by);
+    /* Relaxed trees can be taller than the index is wide */
+    if (shift >= (int)sizeof(int) * 8 - 1)
+        return 0;
+
+    return (index >> shift) & SHIFT_MASK;
+}
+
+/*
+Recompute the `dense' flag of `branch' from its size table.
+*/
+
+void
+branch_update_dense(Branch *branch, int height)
+{
+    long long capacity;
+    int shift,
+        i;
+
+    shift = level_shift(height);
+    if (shift >= (int)sizeof(int) * 8 - 1)
+    {   /* No child can be full */
+        branch->dense = branch->length <= 1;
+        return;
+    }
+
+    capacity = 1LL << shift;
+    branch->dense = true;
+    for (i = 0; i < branch->length - 1; i++)
+        if (branch->size_table[i] != capacity * (i + 1))
+        {
+            branch->dense = false;
+            return;
+        }
 }
 
 /*
@@ -83,9 +604,9 @@ are looking for.
 */
 
 int
-compactness(int nodes, int slots)
+compactness(int nodes, int slots, int factor)
 {
-    return nodes - ((slots - 1) / BRANCH_FACTOR) - 1;
+    return nodes - ((slots - 1) / factor) - 1;
 }
 
 /*
@@ -99,92 +620,57 @@ Given two arrays of pointers to leafs, read from `src' and push merged leafs on
 
 The amount of leafs to merge is specified by `length'. Note that a buffer
 overrun will happen if `dst' does not have enough space to store all the
-resulting leafs.
+resulting leafs. A full leaf that starts where a new one would, is pushed on
+`dst' as it is instead of being copied.
 */
 
 void
 squash_leafs(Leaf **src, Leaf **dst, int length)
 {
-    int node_i, // index into the `src' leaf array
-        slot_i; // index into the curent leaf's slot array
+    int node_i,  // index into the `src' leaf array
+        copied,  // items of the current leaf copied so far
+        prev_len;
     Leaf *leaf; // leaf in which the item of the loose leafs are squashed
 
-    if (length == 0)
-        return;
-
-    leaf = LeafNew();
+    leaf = NULL;
     for (node_i = 0; node_i < length; node_i++)
     {
         Leaf *curr_leaf;
-       
-        curr_leaf = src[node_i];
-        for (slot_i = 0; slot_i < curr_leaf->length; slot_i++)
-        {
-            bool pushed;   // managed to push a value into the squashing leaf
-            int curr_item; 
 
-            curr_item = curr_leaf->slots[slot_i];
-            pushed = LeafPush(leaf, curr_item);
-            if (!pushed)
-            {
-                *dst++ = leaf;
-                leaf = LeafNew();
-                LeafPush(leaf, curr_item);
-            }
+        curr_leaf = src[node_i];
+        if (leaf == NULL && curr_leaf->length == LEAF_FACTOR)
+        {   /* It would be copied as it is, share it instead */
+            *dst++ = LeafRetain(curr_leaf);
+            continue;
         }
-    }
-
-    if (leaf->length)
-        *dst = leaf;
-}
-
-void
-squash_branches(Branch **src, Branch **dst, int length)
-{
-    int node_i,
-        slot_i;
-    Branch *branch;
-
-    if (length == 0)
-        return;
 
-    branch = BranchNew();
-    for (node_i = 0; node_i < length; node_i++)
-    {
-        Branch *curr_branch;
-
-        curr_branch = src[node_i];
-        for (slot_i = 0; slot_i < curr_branch->length; slot_i++)
+        copied = 0;
+        while (copied < curr_leaf->length)
         {
-            bool pushed;
-            int curr_slot_len;
-            void *curr_slot;
-
-            if (slot_i)
-                curr_slot_len = curr_branch->size_table[slot_i] -
-                                curr_branch->size_table[slot_i - 1];
-            else
-                curr_slot_len = curr_branch->size_table[slot_i];
+            if (leaf == NULL)
+                leaf = LeafNew();
 
-            curr_slot = curr_branch->slots[slot_i];
-            pushed = BranchPushNode(branch, curr_slot, curr_slot_len);
-            if (!pushed)
+            prev_len = leaf->length;
+            LeafPushArray(leaf, curr_leaf->length - copied,
+                          curr_leaf->slots + copied);
+            copied += leaf->length - prev_len;
+            if (leaf->length == LEAF_FACTOR)
             {
-                *dst++ = branch;
-                branch = BranchNew();
-                BranchPushNode(branch, curr_slot, curr_slot_len);
+                *dst++ = leaf;
+                leaf = NULL;
             }
         }
     }
 
-    if (branch->length)
-        *dst = branch;
+    if (leaf)
+        *dst = leaf;
 }
 
 /*
 Given an array of leafs, merge them until we are left with `to_remove' fewer
-nodes. For example, passing the following `src' with a `to_remove' of 1, would
-return the following `ret' leaf array.
+nodes, and store the resulting leafs in `ret', which has room for as many as
+`src' holds. For example, passing the following `src' with a `to_remove' of 1,
+would store the following leafs in `ret'.
 
          0┌──┬──┬──┬──┐1┌──┬──┐2┌──┬──┬──┐3┌──┬──┐4┌──┬──┐5┌──┬──┬──┐6
      src  │ 1│ 2│ 3│ 4│ │ 5│ 6│ │ 7│ 8│ 9│ │10│11│ │12│13│ │14│15│16│
@@ -211,24 +697,26 @@ Continuing with the above example:
  └──┴──┘ └──┴──┴──┘ └──┴──┘
 
 Thus, we can satisfy a `to_remove' constraint of 1 by squashing leafs indexes
-1 to 4.
+1 to 4. The leafs outside of the squashed run are shared with `src', and a
+`to_remove' of 0 or less only shares all of them.
 */
 
-Leaf **
-merge_leafs(Leaf **src, int src_len, int to_remove)
+void
+merge_leafs(Leaf **src, int src_len, int to_remove, Leaf **ret)
 {
     int src_i,
         ret_i;
-    Leaf **ret;
-
-    if (to_remove == 0)
-        return src;
 
     src_i = ret_i = 0;
-    ret = malloc(sizeof(Leaf *) * (src_len - to_remove));
+    if (to_remove <= 0)
+    {
+        while (src_i < src_len)
+            ret[ret_i++] = LeafRetain(src[src_i++]);
+        return;
+    }
 
-    while (src[src_i]->length == BRANCH_FACTOR)
-        ret[ret_i++] = src[src_i++];
+    while (src[src_i]->length == LEAF_FACTOR)
+        ret[ret_i++] = LeafRetain(src[src_i++]);
 
     {
         int selected_nodes,
@@ -242,7 +730,7 @@ merge_leafs(Leaf **src, int src_len, int to_remove)
             assert(selected_nodes + src_i <= src_len);
 
             selected_slots += src[src_i + selected_nodes - 1]->length;
-            squashed_nodes = ((selected_slots - 1) / BRANCH_FACTOR) + 1;
+            squashed_nodes = ((selected_slots - 1) / LEAF_FACTOR) + 1;
             if (squashed_nodes <= selected_nodes - to_remove)
             {
                 squash_leafs(src + src_i, ret + src_i, selected_nodes);
@@ -256,26 +744,141 @@ merge_leafs(Leaf **src, int src_len, int to_remove)
     }
 
     while (src_i < src_len)
-        ret[ret_i++] = src[src_i++];
-
-    return ret;
+        ret[ret_i++] = LeafRetain(src[src_i++]);
 }
 
-Branch **
-merge_branches(Branch **src, int src_len, int to_remove)
-{
-    int src_i,
-        ret_i;
-    Branch **ret;
+/*
+The compactness of `branch' of `height', counting the slots its children
+fill.
+*/
+
+int
+branch_compactness(Branch *branch, int height)
+{
+    int slots,
+        i;
+
+    if (height == 1)
+        return compactness(branch->length, BranchSize(branch), LEAF_FACTOR);
+
+    slots = 0;
+    for (i = 0; i < branch->length; i++)
+        slots += ((Branch *)branch->slots[i])->length;
+
+    return compactness(branch->length, slots, BRANCH_FACTOR);
+}
+
+/*
+Merge the children of the new or owned `branch' of `height' until it is no
+less compact than AVG_COMPACT allows. The branches next to each other along a
+seam only keep within it as a whole, the one squashing them together may not.
+Merged branches have their own children merged the same way, which can take
+slots from `branch' again, hence the loop.
+*/
+
+void
+branch_merge_children(Branch *branch, int height)
+{
+    void *merged[BRANCH_FACTOR];
+    int to_remove,
+        length,
+        i;
+
+    while ((to_remove = branch_compactness(branch, height) - AVG_COMPACT) > 0)
+    {
+        if (height == 1)
+            merge_leafs((Leaf **)branch->slots, branch->length, to_remove,
+                        (Leaf **)merged);
+        else
+            merge_branches((Branch **)branch->slots, branch->length,
+                           to_remove, (Branch **)merged, height - 1);
+        length = branch->length;
+        for (i = 0; i < length; i++)
+            NodeRelease(branch->slots[i], height - 1);
+        branch->length = 0;
+        for (i = 0; i < length - to_remove; i++)
+            BranchPushNode(branch, merged[i],
+                           height == 1 ? ((Leaf *)merged[i])->length :
+                                         BranchSize(merged[i]));
+        branch_update_dense(branch, height);
+    }
+}
+
+/*
+Same as squash_leafs, for branches of `height'. The branches it fills are
+flagged dense where their children allow. Branches of leafs can pick up the
+loose children of several earlier seams this way, so they are merged back
+within AVG_COMPACT, see branch_merge_children.
+*/
+
+void
+squash_branches(Branch **src, Branch **dst, int length, int height)
+{
+    int node_i,
+        slot_i;
+    Branch *branch;
 
-    if (to_remove == 0)
-        return src;
+    branch = NULL;
+    for (node_i = 0; node_i < length; node_i++)
+    {
+        Branch *curr_branch;
+
+        curr_branch = src[node_i];
+        if (branch == NULL && curr_branch->length == BRANCH_FACTOR)
+        {
+            *dst++ = BranchRetain(curr_branch);
+            continue;
+        }
+
+        for (slot_i = 0; slot_i < curr_branch->length; slot_i++)
+        {
+            int curr_slot_len;
+
+            if (slot_i)
+                curr_slot_len = curr_branch->size_table[slot_i] -
+                                curr_branch->size_table[slot_i - 1];
+            else
+                curr_slot_len = curr_branch->size_table[slot_i];
+
+            if (branch == NULL)
+                branch = BranchNew();
+            BranchPushNode(branch, NodeRetain(curr_branch->slots[slot_i]),
+                           curr_slot_len);
+            if (branch->length == BRANCH_FACTOR)
+            {
+                branch_merge_children(branch, height);
+                branch_update_dense(branch, height);
+                *dst++ = branch;
+                branch = NULL;
+            }
+        }
+    }
+
+    if (branch)
+    {
+        branch_merge_children(branch, height);
+        branch_update_dense(branch, height);
+        *dst = branch;
+    }
+}
+
+void
+merge_branches(Branch **src, int src_len, int to_remove, Branch **ret,
+               int height)
+{
+    int src_i,
+        ret_i;
 
     src_i = ret_i = 0;
-    ret = malloc(sizeof(Branch *) * (src_len - to_remove));
+    if (to_remove <= 0)
+    {
+        while (src_i < src_len)
+            ret[ret_i++] = BranchRetain(src[src_i++]);
+        return;
+    }
 
     while (src[src_i]->length == BRANCH_FACTOR)
-        ret[ret_i++] = src[src_i++];
+        ret[ret_i++] = BranchRetain(src[src_i++]);
 
     {
         int selected_nodes,
@@ -292,7 +895,8 @@ merge_branches(Branch **src, int src_len, int to_remove)
             squashed_nodes = ((selected_slots - 1) / BRANCH_FACTOR) + 1;
             if (squashed_nodes <= selected_nodes - to_remove)
             {
-                squash_branches(src + src_i, ret + src_i, selected_nodes);
+                squash_branches(src + src_i, ret + src_i, selected_nodes,
+                                height);
                 src_i += selected_nodes;
                 ret_i += squashed_nodes;
                 break;
@@ -303,9 +907,7 @@ merge_branches(Branch **src, int src_len, int to_remove)
     }
 
     while (src_i < src_len)
-        ret[ret_i++] = src[src_i++];
-
-    return ret;
+        ret[ret_i++] = BranchRetain(src[src_i++]);
 }
 
 void *
@@ -315,49 +917,186 @@ NodeNew(int height)
 }
 
 bool
-NodePush(void *node, int height, int value)
+NodePush(void *node, int height, Elem value)
 {
     return height ? BranchPush(node, height, value) : LeafPush(node, value);
 }
 
 int
+NodeSize(void *node, int height)
+{
+    return height ? BranchSize(node) : ((Leaf *)node)->length;
+}
+
+Elem
 NodeGet(void *node, int height, int index)
 {
     return height ? BranchGet(node, height, index) : LeafGet(node, index);
 }
 
-void NodeSet(void *node, int height, int index, int value)
+void NodeSet(void *node, int height, int index, Elem value)
 {
     return height ? BranchSet(node, height, index, value) :
                     LeafSet(node, index, value);
 }
+
+void *
+NodeAssoc(void *node, int edit, int height, int index, Elem value)
+{
+    return height ? (void *)BranchAssoc(node, edit, height, index, value) :
+                    (void *)LeafAssoc(node, edit, index, value);
+}
+
+void *
+NodeFill(void *node, int edit, int height, int from, int to, Elem value)
+{
+    return height ? (void *)BranchFill(node, edit, height, from, to, value) :
+                    (void *)LeafFill(node, edit, from, to, value);
+}
+
+void *
+NodeRemove(void *node, int edit, int height, int from, int to)
+{
+    return height ? (void *)BranchRemove(node, edit, height, from, to) :
+                    (void *)LeafRemove(node, edit, from, to);
+}
+
+void *
+NodeTake(void *node, int height, int n)
+{
+    return height ? (void *)BranchTake(node, height, n) :
+                    (void *)LeafTake(node, n);
+}
+
+void *
+NodeDrop(void *node, int height, int n)
+{
+    return height ? (void *)BranchDrop(node, height, n) :
+                    (void *)LeafDrop(node, n);
+}
+
+int *
+node_refs(void *node)
+{
+    /* Both node types start with their reference count */
+    return &((Leaf *)node)->refs;
+}
+
+void *
+NodeRetain(void *node)
+{
+    REFS_INC(*node_refs(node));
+    return node;
+}
+
+/*
+Drop a reference to `node', freeing it along with all of its descendants that
+are no longer referenced either. Rather than recursing, the branches left to
+free are kept on an explicit stack, each of their children being released
+before it is pushed, so that only unreferenced nodes ever make it on there.
+The stack starts out on the C stack, deep enough for the trees of up to 8
+levels, and only moves to the heap for taller ones.
+*/
+
+typedef struct release_frame release_frame;
+
+struct release_frame
+{
+    Branch *branch;
+    int height;
+};
+
+void
+NodeRelease(void *node, int height)
+{
+    release_frame initial[BRANCH_FACTOR * 8],
+                  *stack;
+    int stack_len,
+        stack_cap;
+
+    if (REFS_DEC(*node_refs(node)))
+        return;
+    if (height == 0)
+    {
+        node_free(node, sizeof(Leaf));
+        return;
+    }
+
+    stack_cap = BRANCH_FACTOR * 8;
+    stack = initial;
+    stack[0].branch = node;
+    stack[0].height = height;
+    stack_len = 1;
+    while (stack_len)
+    {
+        Branch *branch;
+        int i;
+
+        stack_len--;
+        branch = stack[stack_len].branch;
+        height = stack[stack_len].height;
+        for (i = 0; i < branch->length; i++)
+        {
+            void *child;
+
+            child = branch->slots[i];
+            if (REFS_DEC(*node_refs(child)))
+                continue;
+
+            if (height == 1)
+                node_free(child, sizeof(Leaf));
+            else
+            {
+                if (stack_len == stack_cap)
+                {
+                    stack_cap *= 2;
+                    if (stack == initial)
+                    {
+                        stack = malloc(sizeof(*stack) * stack_cap);
+                        memcpy(stack, initial, sizeof(initial));
+                    }
+                    else
+                        stack = realloc(stack, sizeof(*stack) * stack_cap);
+                }
+                stack[stack_len].branch = child;
+                stack[stack_len].height = height - 1;
+                stack_len++;
+            }
+        }
+        node_free(branch, sizeof(Branch));
+    }
+
+    if (stack != initial)
+        free(stack);
+}
 /* LEAF */
 
 Leaf *
 LeafNew(void)
 {
-    return calloc(1, sizeof(Leaf));
+    Leaf *leaf;
+
+    leaf = node_alloc(sizeof(Leaf));
+    leaf->refs = 1;
+
+    return leaf;
 }
 
 Leaf *
-LeafFromArr(int *arr, int arr_len)
+LeafFromArr(Elem *arr, int arr_len)
 {
     Leaf *leaf;
-    int i;
 
     leaf = LeafNew();
-    for (i = 0; i < arr_len; i++)
-        LeafPush(leaf, arr[i]);
+    LeafPushArray(leaf, arr_len, arr);
 
     return leaf;
 }
 
 bool
-LeafPush(Leaf *leaf, int value)
+LeafPush(Leaf *leaf, Elem value)
 {
-    int len = leaf->length;
-
-    if (leaf->length != BRANCH_FACTOR)
+    if (leaf->length != LEAF_FACTOR)
     {
         leaf->slots[leaf->length] = value;
         leaf->length++;
@@ -367,25 +1106,173 @@ LeafPush(Leaf *leaf, int value)
         return false;
 }
 
-int
+Elem
 LeafGet(Leaf *leaf, int index)
 {
     return leaf->slots[index];
 }
 
 void
-LeafSet(Leaf *leaf, int index, int value)
+LeafSet(Leaf *leaf, int index, Elem value)
 {
     leaf->slots[index] = value;
 }
 
+/*
+Append as many items of `arr' as there is room for in `leaf'.
+*/
+
+void
+LeafPushArray(Leaf *leaf, int arr_len, const Elem *arr)
+{
+    if (arr_len > LEAF_FACTOR - leaf->length)
+        arr_len = LEAF_FACTOR - leaf->length;
+
+    memcpy(leaf->slots + leaf->length, arr, arr_len * sizeof(Elem));
+    leaf->length += arr_len;
+}
+
+Leaf *
+LeafCopy(Leaf *leaf)
+{
+    Leaf *copy;
+
+    copy = LeafNew();
+    *copy = *leaf;
+    copy->refs = 1;
+    copy->edit = 0;
+
+    return copy;
+}
+
+Leaf *
+LeafRetain(Leaf *leaf)
+{
+    REFS_INC(leaf->refs);
+    return leaf;
+}
+
 void
-LeafPushArray(Leaf *leaf, int arr_len, int *arr)
+LeafRelease(Leaf *leaf)
+{
+    if (REFS_DEC(leaf->refs) == 0)
+        node_free(leaf, sizeof(Leaf));
+}
+
+/*
+Return `leaf' if it can be updated in place, i.e. it is owned by `edit' and no
+other node or tree refers to it. Otherwise return an owned copy of it, giving
+up the reference to `leaf' held by the caller.
+*/
+
+Leaf *
+LeafEditable(Leaf *leaf, int edit)
+{
+    Leaf *copy;
+
+    if (edit && leaf->edit == edit && REFS_LOAD(leaf->refs) == 1)
+        return leaf;
+
+    copy = LeafCopy(leaf);
+    copy->edit = edit;
+    LeafRelease(leaf);
+
+    return copy;
+}
+
+Leaf *
+LeafAssoc(Leaf *leaf, int edit, int index, Elem value)
+{
+    leaf = LeafEditable(leaf, edit);
+    leaf->slots[index] = value;
+
+    return leaf;
+}
+
+/*
+Set the items of `leaf' from `from' up to `to' to `value', like LeafAssoc.
+*/
+
+Leaf *
+LeafFill(Leaf *leaf, int edit, int from, int to, Elem value)
 {
     int i;
 
-    for (i = 0; i < arr_len; i++)
-        LeafPush(leaf, arr[i]);
+    leaf = LeafEditable(leaf, edit);
+    for (i = from; i < to; i++)
+        leaf->slots[i] = value;
+
+    return leaf;
+}
+
+/*
+Insert the `arr_len' items of `arr' in front of item `index' of `leaf', which
+has room for them, like LeafAssoc.
+*/
+
+Leaf *
+LeafInsert(Leaf *leaf, int edit, int index, int arr_len, const Elem *arr)
+{
+    assert(leaf->length + arr_len <= LEAF_FACTOR);
+    leaf = LeafEditable(leaf, edit);
+    memmove(leaf->slots + index + arr_len, leaf->slots + index,
+            (leaf->length - index) * sizeof(Elem));
+    memcpy(leaf->slots + index, arr, arr_len * sizeof(Elem));
+    leaf->length += arr_len;
+
+    return leaf;
+}
+
+/*
+Remove the items of `leaf' from `from' up to `to', like LeafAssoc.
+*/
+
+Leaf *
+LeafRemove(Leaf *leaf, int edit, int from, int to)
+{
+    leaf = LeafEditable(leaf, edit);
+    memmove(leaf->slots + from, leaf->slots + to,
+            (leaf->length - to) * sizeof(Elem));
+    leaf->length -= to - from;
+
+    return leaf;
+}
+
+/*
+Return a leaf holding the first `n' items of `leaf', which is shared when all
+of them are kept.
+*/
+
+Leaf *
+LeafTake(Leaf *leaf, int n)
+{
+    Leaf *ret;
+
+    if (n == leaf->length)
+        return LeafRetain(leaf);
+
+    ret = LeafNew();
+    LeafPushArray(ret, n, leaf->slots);
+
+    return ret;
+}
+
+/*
+Return a leaf holding the items of `leaf' past the first `n'.
+*/
+
+Leaf *
+LeafDrop(Leaf *leaf, int n)
+{
+    Leaf *ret;
+
+    if (n == 0)
+        return LeafRetain(leaf);
+
+    ret = LeafNew();
+    LeafPushArray(ret, leaf->length - n, leaf->slots + n);
+
+    return ret;
 }
 
 /* NODE */
@@ -393,7 +1280,12 @@ LeafPushArray(Leaf *leaf, int arr_len, int *arr)
 Branch *
 BranchNew(void)
 {
-    return calloc(1, sizeof(Branch));
+    Branch *branch;
+
+    branch = node_alloc(sizeof(Branch));
+    branch->refs = 1;
+
+    return branch;
 }
 
 Branch *
@@ -419,321 +1311,4984 @@ BranchFromBranchArr(Branch *arr[], int arr_len)
     for (i = 0; i < arr_len; i++)
         BranchPushNode(branch, arr[i], arr[i]->length);
 
-    return branch;
+    return branch;
+}
+
+bool
+BranchPush(Branch *branch, int height, Elem value)
+{
+    int last_slot;
+
+    last_slot = branch->length - 1;
+    if
+    (
+        branch->length != 0 &&
+        NodePush(branch->slots[last_slot], height - 1, value)
+    )   /* Could push in last slot */
+        branch->size_table[last_slot]++;
+    else if (branch->length != BRANCH_FACTOR)
+    {   /* Can allocate new slot and push there */
+        branch->slots[branch->length] = NodeNew(height - 1);
+        NodePush(branch->slots[branch->length], height - 1, value);
+
+        branch->size_table[branch->length] =
+                branch->length ? branch->size_table[last_slot] + 1 : 1;
+        branch->length++;
+    }
+    else /* Value cannot be pushed in the children of this branch */
+        return false;
+
+    return true;
+}
+
+#ifdef SIMD_X86
+
+/*
+The vector searches count the entries among the first `length' of `table'
+that are not past `index'. A size table is ascending, so that count is the
+slot of the index. A vector of entries is compared at once, the comparison
+turned into a bit mask whose bits are counted, and the search stops at the
+first vector with an entry past the index. The entries past `length' are
+read but masked out, which stays within the table as it has BRANCH_FACTOR
+entries, a multiple of the vector width.
+*/
+
+enum { SIMD_NONE, SIMD_SSE2, SIMD_AVX2 };
+
+int simd_level;
+
+__attribute__((constructor)) void
+simd_init(void)
+{
+    __builtin_cpu_init();
+    if (BRANCH_FACTOR >= 8 && __builtin_cpu_supports("avx2"))
+        simd_level = SIMD_AVX2;
+    else if (__builtin_cpu_supports("sse2"))
+        simd_level = SIMD_SSE2;
+    else
+        simd_level = SIMD_NONE;
+}
+
+__attribute__((target("sse2"))) int
+size_table_sse2(const int *table, int length, int index, int from)
+{
+    __m128i key;
+    int count,
+        past,
+        i;
+
+    key = _mm_set1_epi32(index);
+    count = from & ~3;
+    for (i = count; i < length; i += 4)
+    {
+        past = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(
+                   _mm_loadu_si128((const __m128i *)(table + i)), key)));
+        if (length - i < 4)
+            past = (past | 0xf << (length - i)) & 0xf;
+        count += 4 - __builtin_popcount(past);
+        if (past)
+            break;
+    }
+
+    return count;
+}
+
+__attribute__((target("avx2"))) int
+size_table_avx2(const int *table, int length, int index, int from)
+{
+    __m256i key;
+    int count,
+        past,
+        i;
+
+    key = _mm256_set1_epi32(index);
+    count = from & ~7;
+    for (i = count; i < length; i += 8)
+    {
+        past = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(
+                   _mm256_loadu_si256((const __m256i *)(table + i)), key)));
+        if (length - i < 8)
+            past = (past | 0xff << (length - i)) & 0xff;
+        count += 8 - __builtin_popcount(past);
+        if (past)
+            break;
+    }
+
+    return count;
+}
+
+#endif
+
+/*
+Return the first slot from `from' on whose entry in `table' is past `index'.
+In a compact tree that is mostly the slot at `from', which is checked first
+as that is cheaper than setting up a vector search.
+*/
+
+int
+size_table_search(const int *table, int length, int index, int from)
+{
+    if (index < table[from])
+        return from;
+    from++;
+
+#ifdef SIMD_X86
+    if (simd_level == SIMD_AVX2)
+        return size_table_avx2(table, length, index, from);
+    if (simd_level == SIMD_SSE2)
+        return size_table_sse2(table, length, index, from);
+#else
+    (void)length;
+#endif
+
+    while (index >= table[from])
+        from++;
+
+    return from;
+}
+
+/*
+Find the slot of `branch' containing `*index', and rebase `*index' so that it
+indexes into that slot. The radix shift gives the lowest slot the index can be
+in, as no child holds more than 1 << level_shift(height) items, and it is the
+exact slot when the branch is dense. Otherwise we search the size table for
+the first slot ending past the index, with a vector search where there is
+one, or by probing on from the radix slot.
+*/
+
+int
+branch_slot(Branch *branch, int height, int *index)
+{
+    int shifted_index;
+
+    if (branch->dense)
+    {
+        int shift;
+
+        shift = level_shift(height);
+        if (shift >= (int)sizeof(int) * 8 - 1)
+            return 0;
+
+        shifted_index = (*index >> shift) & SHIFT_MASK;
+        *index &= (1 << shift) - 1;
+        return shifted_index;
+    }
+
+    shifted_index = shift_index(*index, height);
+    if (*index >= branch->size_table[shifted_index])
+        /* Not in the radix slot, search the slots after it */
+        shifted_index = size_table_search(branch->size_table, branch->length,
+                                          *index, shifted_index + 1);
+
+    if (shifted_index)
+        *index -= branch->size_table[shifted_index - 1];
+
+    return shifted_index;
+}
+
+/*
+Step from `branch' down into the child holding `*index'. While the caller
+waits on the header of the child, start fetching the slot it is most likely
+to read next, which is exact when the child is dense.
+*/
+
+void *
+branch_step(Branch *branch, int height, int *index)
+{
+    void *child;
+
+    child = branch->slots[branch_slot(branch, height, index)];
+    if (height > 1)
+        PREFETCH(&((Branch *)child)->slots[shift_index(*index, height - 1)]);
+    else
+        PREFETCH(&((Leaf *)child)->slots[*index]);
+
+    return child;
+}
+
+/*
+The child in `slot' of `branch'. In a tree mapped from a file, `map' is the
+start of the mapping and the slots hold the offsets of the children from it.
+*/
+
+void *
+branch_child(const char *map, Branch *branch, int slot)
+{
+    if (map)
+        return (void *)(map + (size_t)branch->slots[slot]);
+    return branch->slots[slot];
+}
+
+/*
+Iterative lookup of `index' under `node'. The heights most trees have are
+unrolled by falling through the cases of the switch, so that each step is
+compiled with its shift known, taller trees loop down to the unrolled part.
+*/
+
+Elem
+trie_get(void *node, int height, int index)
+{
+    while (height > 8)
+        node = branch_step(node, height--, &index);
+
+    switch (height)
+    {
+    case 8: node = branch_step(node, 8, &index); /* fall through */
+    case 7: node = branch_step(node, 7, &index); /* fall through */
+    case 6: node = branch_step(node, 6, &index); /* fall through */
+    case 5: node = branch_step(node, 5, &index); /* fall through */
+    case 4: node = branch_step(node, 4, &index); /* fall through */
+    case 3: node = branch_step(node, 3, &index); /* fall through */
+    case 2: node = branch_step(node, 2, &index); /* fall through */
+    case 1: node = branch_step(node, 1, &index); /* fall through */
+    default: break;
+    }
+
+    return ((Leaf *)node)->slots[index];
+}
+
+/*
+Lookup of `index' under `node' in a trie mapped at `map'.
+*/
+
+Elem
+mapped_get(const char *map, void *node, int height, int index)
+{
+    int slot;
+
+    for (; height; height--)
+    {
+        slot = branch_slot(node, height, &index);
+        node = branch_child(map, node, slot);
+    }
+
+    return ((Leaf *)node)->slots[index];
+}
+
+Elem
+BranchGet(Branch *branch, int height, int index)
+{
+    int slot;
+
+    slot = branch_slot(branch, height, &index);
+    return trie_get(branch->slots[slot], height - 1, index);
+}
+
+void
+BranchSet(Branch *branch, int height, int index, Elem value)
+{
+    int slot;
+
+    slot = branch_slot(branch, height, &index);
+    NodeSet(branch->slots[slot], height - 1, index, value);
+}
+
+Branch *
+BranchCopy(Branch *branch)
+{
+    Branch *copy;
+    int i;
+
+    copy = BranchNew();
+    *copy = *branch;
+    copy->refs = 1;
+    copy->edit = 0;
+    for (i = 0; i < copy->length; i++)
+        NodeRetain(copy->slots[i]);
+
+    return copy;
+}
+
+Branch *
+BranchRetain(Branch *branch)
+{
+    REFS_INC(branch->refs);
+    return branch;
+}
+
+void
+BranchRelease(Branch *branch, int height)
+{
+    NodeRelease(branch, height);
+}
+
+/*
+Same as LeafEditable, `height' is needed to release `branch' when it gets
+copied.
+*/
+
+Branch *
+BranchEditable(Branch *branch, int edit, int height)
+{
+    Branch *copy;
+
+    if (edit && branch->edit == edit && REFS_LOAD(branch->refs) == 1)
+        return branch;
+
+    copy = BranchCopy(branch);
+    copy->edit = edit;
+    BranchRelease(branch, height);
+
+    return copy;
+}
+
+/*
+Counterpart of BranchSet that only updates nodes owned by `edit', the path
+leading to `index' is copied where needed and the resulting branch returned,
+every other node is shared with `branch'.
+*/
+
+Branch *
+BranchAssoc(Branch *branch, int edit, int height, int index, Elem value)
+{
+    int slot;
+
+    slot = branch_slot(branch, height, &index);
+    branch = BranchEditable(branch, edit, height);
+    branch->slots[slot] =
+            NodeAssoc(branch->slots[slot], edit, height - 1, index, value);
+
+    return branch;
+}
+
+/*
+Set the items under `branch' from `from' up to `to' to `value', copying the
+paths to every leaf in the range where needed, like BranchAssoc.
+*/
+
+Branch *
+BranchFill(Branch *branch, int edit, int height, int from, int to, Elem value)
+{
+    int start,
+        end,
+        i;
+
+    branch = BranchEditable(branch, edit, height);
+    for (i = 0; i < branch->length; i++)
+    {
+        start = i ? branch->size_table[i - 1] : 0;
+        end = branch->size_table[i];
+        if (end <= from)
+            continue;
+        if (start >= to)
+            break;
+
+        branch->slots[i] = NodeFill(branch->slots[i], edit, height - 1,
+                                    (from > start ? from : start) - start,
+                                    (to < end ? to : end) - start,
+                                    value);
+    }
+
+    return branch;
+}
+
+/*
+Recompute the size table of `branch' from its children, along with its
+`dense' flag.
+*/
+
+void
+branch_update_sizes(Branch *branch, int height)
+{
+    int size,
+        i;
+
+    size = 0;
+    for (i = 0; i < branch->length; i++)
+    {
+        size += NodeSize(branch->slots[i], height - 1);
+        branch->size_table[i] = size;
+    }
+    branch_update_dense(branch, height);
+}
+
+/*
+Give the owned `branch' the `count' children in `children', which may be one
+more than it has slots for. It is then split in two halves, and the second
+one is returned, NULL otherwise. Either half can end up less compact than
+the whole was, so their children are merged as needed.
+*/
+
+Branch *
+branch_set_children(Branch *branch, int edit, int height,
+                    void **children, int count)
+{
+    Branch *sibling;
+    int keep,
+        i;
+
+    keep = count > BRANCH_FACTOR ? count / 2 : count;
+    for (i = 0; i < keep; i++)
+        branch->slots[i] = children[i];
+    branch->length = keep;
+    branch_update_sizes(branch, height);
+    branch_merge_children(branch, height);
+    if (keep == count)
+        return NULL;
+
+    sibling = BranchNew();
+    sibling->edit = edit;
+    for (i = keep; i < count; i++)
+        sibling->slots[i - keep] = children[i];
+    sibling->length = count - keep;
+    branch_update_sizes(sibling, height);
+    branch_merge_children(sibling, height);
+
+    return sibling;
+}
+
+/*
+Insert the items of `arr' in front of item `index' of the full leaf in `slot'
+of the owned `branch', a branch of height 1, and store the leafs the branch
+is left with in `children', returning their number. The leafs from `slot' on,
+or before it, are squashed together with the items until they fit in them,
+when the leafs of the branch have room for the items. Otherwise the leaf
+alone is squashed with them into two leafs, and the branch gets one more.
+*/
+
+int
+branch_squash_insert(Branch *branch, int slot, int index,
+                     int arr_len, const Elem *arr, void **children)
+{
+    Leaf *src[BRANCH_FACTOR + 2],
+         *dst[BRANCH_FACTOR + 1],
+         *leaf,
+         *items;
+    int first,
+        last,
+        room,
+        total,
+        num_src,
+        num_dst,
+        count,
+        i;
+
+    first = last = slot;
+    if (BranchSize(branch) + arr_len <= branch->length * LEAF_FACTOR)
+    {
+        room = LEAF_FACTOR - ((Leaf *)branch->slots[slot])->length;
+        while (room < arr_len && last + 1 < branch->length)
+            room += LEAF_FACTOR - ((Leaf *)branch->slots[++last])->length;
+        while (room < arr_len)
+            room += LEAF_FACTOR - ((Leaf *)branch->slots[--first])->length;
+    }
+
+    leaf = branch->slots[slot];
+    items = LeafNew();
+    LeafPushArray(items, arr_len, arr);
+    num_src = 0;
+    for (i = first; i < slot; i++)
+        src[num_src++] = branch->slots[i];
+    src[num_src++] = LeafTake(leaf, index);
+    src[num_src++] = items;
+    src[num_src++] = LeafDrop(leaf, index);
+    for (i = slot + 1; i <= last; i++)
+        src[num_src++] = branch->slots[i];
+
+    total = arr_len;
+    for (i = first; i <= last; i++)
+        total += ((Leaf *)branch->slots[i])->length;
+    num_dst = (total + LEAF_FACTOR - 1) / LEAF_FACTOR;
+    squash_leafs(src, dst, num_src);
+
+    LeafRelease(src[slot - first]);
+    LeafRelease(items);
+    LeafRelease(src[slot - first + 2]);
+    for (i = first; i <= last; i++)
+        LeafRelease(branch->slots[i]);
+
+    count = 0;
+    for (i = 0; i < first; i++)
+        children[count++] = branch->slots[i];
+    for (i = 0; i < num_dst; i++)
+        children[count++] = dst[i];
+    for (i = last + 1; i < branch->length; i++)
+        children[count++] = branch->slots[i];
+
+    return count;
+}
+
+/*
+Insert the items of `arr' in front of item `index' under `branch', into the
+leaf holding that item where it has room for them. Otherwise the leafs next
+to it take up the items, or the leaf is split, see branch_squash_insert.
+A branch left with more children than it has slots for is split in two
+halves, the second of which is stored in `*split' for the caller to insert
+next to `branch', which is NULL when there is none.
+*/
+
+Branch *
+BranchInsert(Branch *branch, int edit, int height, int index,
+             int arr_len, const Elem *arr, Branch **split)
+{
+    void *children[BRANCH_FACTOR + 1];
+    Branch *child_split;
+    int child_len,
+        slot,
+        count,
+        i;
+
+    *split = NULL;
+    child_len = 0;
+    slot = branch_slot(branch, height, &index);
+    branch = BranchEditable(branch, edit, height);
+    if (height == 1)
+    {
+        if (((Leaf *)branch->slots[slot])->length + arr_len > LEAF_FACTOR)
+        {
+            count = branch_squash_insert(branch, slot, index, arr_len, arr,
+                                         children);
+            *split = branch_set_children(branch, edit, height,
+                                         children, count);
+            return branch;
+        }
+
+        branch->slots[slot] = LeafInsert(branch->slots[slot], edit, index,
+                                         arr_len, arr);
+    }
+    else
+    {
+        child_len = ((Branch *)branch->slots[slot])->length;
+        branch->slots[slot] = BranchInsert(branch->slots[slot], edit,
+                                           height - 1, index, arr_len, arr,
+                                           &child_split);
+        if (child_split)
+        {
+            count = 0;
+            for (i = 0; i < branch->length; i++)
+            {
+                children[count++] = branch->slots[i];
+                if (i == slot)
+                    children[count++] = child_split;
+            }
+            *split = branch_set_children(branch, edit, height,
+                                         children, count);
+            return branch;
+        }
+    }
+
+    for (i = slot; i < branch->length; i++)
+        branch->size_table[i] += arr_len;
+    if (slot != branch->length - 1)
+        branch->dense = false;
+    if (height > 1 && ((Branch *)branch->slots[slot])->length != child_len)
+        /* The child merged its own children, taking slots from `branch' */
+        branch_merge_children(branch, height);
+
+    return branch;
+}
+
+/*
+Remove the items under `branch' from `from' up to `to', which must all be in
+the same leaf and not all of it. A branch whose child shrinks left of its
+last slot is no longer dense.
+*/
+
+Branch *
+BranchRemove(Branch *branch, int edit, int height, int from, int to)
+{
+    int removed,
+        slot,
+        i;
+
+    removed = to - from;
+    slot = branch_slot(branch, height, &from);
+    branch = BranchEditable(branch, edit, height);
+    if (height == 1)
+        branch->slots[slot] = LeafRemove(branch->slots[slot], edit,
+                                         from, from + removed);
+    else
+        branch->slots[slot] = BranchRemove(branch->slots[slot], edit,
+                                           height - 1, from, from + removed);
+    for (i = slot; i < branch->length; i++)
+        branch->size_table[i] -= removed;
+    if (slot != branch->length - 1)
+        branch->dense = false;
+
+    return branch;
+}
+
+/*
+Whether any branch on the path from `branch' of `height' down to item `index'
+is less compact than AVG_COMPACT allows.
+*/
+
+bool
+branch_path_loose(Branch *branch, int height, int index)
+{
+    for (; height; height--)
+    {
+        if (branch_compactness(branch, height) > AVG_COMPACT)
+            return true;
+        if (height > 1)
+            branch = branch->slots[branch_slot(branch, height, &index)];
+    }
+
+    return false;
+}
+
+/*
+Merge the children of the branches on the path from `branch' down to item
+`index' wherever they are less compact than AVG_COMPACT allows, from the
+bottom up, as merging the children of a branch takes slots from its parent.
+Slicing leaves the branches along the cut with fewer slots than their items
+need, which concatenating an empty tree then does not rebalance.
+*/
+
+Branch *
+branch_compact_path(Branch *branch, int edit, int height, int index)
+{
+    int slot;
+
+    slot = branch_slot(branch, height, &index);
+    branch = BranchEditable(branch, edit, height);
+    if (height > 1)
+        branch->slots[slot] = branch_compact_path(branch->slots[slot], edit,
+                                                  height - 1, index);
+    branch_merge_children(branch, height);
+
+    return branch;
+}
+
+/*
+Wrap `leaf' in a chain of single slot branches, so that it can be pushed in a
+branch at `height' + 1.
+*/
+
+void *
+BranchPathTo(Leaf *leaf, int edit, int height)
+{
+    void *node;
+
+    node = leaf;
+    while (height--)
+    {
+        Branch *parent;
+
+        parent = BranchNew();
+        parent->edit = edit;
+        BranchPushNode(parent, node, leaf->length);
+        node = parent;
+    }
+
+    return node;
+}
+
+/*
+Whether a leaf can be pushed as the new rightmost leaf under `branch'.
+*/
+
+bool
+branch_has_room(Branch *branch, int height)
+{
+    while (branch->length == BRANCH_FACTOR)
+    {
+        if (height == 1)
+            return false;
+
+        branch = branch->slots[branch->length - 1];
+        height--;
+    }
+
+    return true;
+}
+
+/*
+Push `leaf' as the new rightmost leaf under `branch', updating the nodes owned
+by `edit' in place and copying the others. Returns the resulting branch, or
+NULL when `leaf' cannot be pushed in the children of `branch', in which case
+nothing was changed. The references to `branch' and `leaf' are handed over.
+*/
+
+Branch *
+BranchConjLeaf(Branch *branch, int edit, int height, Leaf *leaf)
+{
+    int last_slot;
+
+    if (!branch_has_room(branch, height))
+        return NULL;
+
+    branch = BranchEditable(branch, edit, height);
+    last_slot = branch->length - 1;
+    if (height == 1)
+    {
+        BranchPushNode(branch, leaf, leaf->length);
+        branch_update_dense(branch, height);
+    }
+    else if
+    (
+        branch->length != 0 &&
+        branch_has_room(branch->slots[last_slot], height - 1)
+    )
+    {   /* Can push in last slot */
+        branch->slots[last_slot] = BranchConjLeaf(branch->slots[last_slot],
+                                                  edit, height - 1, leaf);
+        branch->size_table[last_slot] += leaf->length;
+    }
+    else
+    {
+        BranchPushNode(branch, BranchPathTo(leaf, edit, height - 1),
+                       leaf->length);
+        branch_update_dense(branch, height);
+    }
+
+    return branch;
+}
+
+/*
+Whether a leaf can be pushed as the new leftmost leaf under `branch'.
+*/
+
+bool
+branch_has_room_first(Branch *branch, int height)
+{
+    while (branch->length == BRANCH_FACTOR)
+    {
+        if (height == 1)
+            return false;
+
+        branch = branch->slots[0];
+        height--;
+    }
+
+    return true;
+}
+
+/*
+Insert `child' as the first slot of `parent', which has room for it, moving
+the other slots up by one.
+*/
+
+void
+branch_push_first(Branch *parent, void *child, int child_len)
+{
+    int i;
+
+    for (i = parent->length; i > 0; i--)
+    {
+        parent->slots[i] = parent->slots[i - 1];
+        parent->size_table[i] = parent->size_table[i - 1] + child_len;
+    }
+    parent->slots[0] = child;
+    parent->size_table[0] = child_len;
+    parent->length++;
+}
+
+/*
+The mirror image of BranchConjLeaf, pushing `leaf' as the new leftmost leaf
+under `branch'. The first slot of the branches along the left spine is then
+usually not full, so every size table entry on the spine is moved along and
+the branches are left relaxed.
+*/
+
+Branch *
+BranchConsLeaf(Branch *branch, int edit, int height, Leaf *leaf)
+{
+    int i;
+
+    if (!branch_has_room_first(branch, height))
+        return NULL;
+
+    branch = BranchEditable(branch, edit, height);
+    if
+    (
+        height > 1 &&
+        branch->length != 0 &&
+        branch_has_room_first(branch->slots[0], height - 1)
+    )
+    {   /* Can push in first slot */
+        branch->slots[0] = BranchConsLeaf(branch->slots[0], edit, height - 1,
+                                          leaf);
+        for (i = 0; i < branch->length; i++)
+            branch->size_table[i] += leaf->length;
+    }
+    else
+        branch_push_first(branch,
+                          height == 1 ?
+                          (void *)leaf : BranchPathTo(leaf, edit, height - 1),
+                          leaf->length);
+    branch_update_dense(branch, height);
+
+    return branch;
+}
+
+/*
+Remove the rightmost leaf under `branch' and hand it over through `leaf',
+updating the nodes owned by `edit' in place and copying the others. Branches
+left without any slot are freed, the result is NULL when that is `branch'
+itself. Dropping from the end keeps a dense branch dense.
+*/
+
+Branch *
+BranchPopLastLeaf(Branch *branch, int edit, int height, Leaf **leaf)
+{
+    Branch *child;
+    int last_slot;
+
+    branch = BranchEditable(branch, edit, height);
+    last_slot = branch->length - 1;
+    if (height == 1)
+    {
+        *leaf = branch->slots[last_slot];
+        child = NULL;
+    }
+    else
+        child = BranchPopLastLeaf(branch->slots[last_slot], edit, height - 1,
+                                  leaf);
+
+    if (child)
+    {
+        branch->slots[last_slot] = child;
+        branch->size_table[last_slot] -= (*leaf)->length;
+    }
+    else if (--branch->length == 0)
+    {
+        node_free(branch, sizeof(Branch));
+        return NULL;
+    }
+
+    return branch;
+}
+
+/*
+Same as BranchPopLastLeaf for the leftmost leaf under `branch'.
+*/
+
+Branch *
+BranchPopFirstLeaf(Branch *branch, int edit, int height, Leaf **leaf)
+{
+    Branch *child;
+    int removed,
+        i;
+
+    branch = BranchEditable(branch, edit, height);
+    if (height == 1)
+    {
+        *leaf = branch->slots[0];
+        child = NULL;
+    }
+    else
+        child = BranchPopFirstLeaf(branch->slots[0], edit, height - 1, leaf);
+
+    removed = (*leaf)->length;
+    if (child)
+    {
+        branch->slots[0] = child;
+        for (i = 0; i < branch->length; i++)
+            branch->size_table[i] -= removed;
+    }
+    else if (--branch->length == 0)
+    {
+        node_free(branch, sizeof(Branch));
+        return NULL;
+    }
+    else
+        for (i = 0; i < branch->length; i++)
+        {
+            branch->slots[i] = branch->slots[i + 1];
+            branch->size_table[i] = branch->size_table[i + 1] - removed;
+        }
+    branch_update_dense(branch, height);
+
+    return branch;
+}
+
+int
+BranchSize(Branch *branch)
+{
+    return branch->length ? branch->size_table[branch->length - 1] : 0;
+}
+
+/*
+Return a branch holding the first `n' items under `branch'. Only the path
+leading to the cut is copied, the children left of it are shared. The copy
+gets its own `dense' flag, as the prefix of a relaxed branch may be dense,
+while a branch returned whole is shared and keeps its flag.
+*/
+
+Branch *
+BranchTake(Branch *branch, int height, int n)
+{
+    Branch *ret;
+    int index,
+        slot,
+        i;
+
+    if (n == BranchSize(branch))
+        return BranchRetain(branch);
+
+    index = n - 1;
+    slot = branch_slot(branch, height, &index);
+
+    ret = BranchNew();
+    for (i = 0; i < slot; i++)
+    {
+        ret->slots[i] = NodeRetain(branch->slots[i]);
+        ret->size_table[i] = branch->size_table[i];
+    }
+    ret->length = slot;
+    BranchPushNode(ret,
+                   NodeTake(branch->slots[slot], height - 1, index + 1),
+                   index + 1);
+    /* A prefix of a dense branch is dense as well */
+    if (branch->dense)
+        ret->dense = true;
+    else
+        branch_update_dense(ret, height);
+
+    return ret;
+}
+
+/*
+Return a branch holding the items under `branch' past the first `n', sharing
+the children right of the cut.
+*/
+
+Branch *
+BranchDrop(Branch *branch, int height, int n)
+{
+    Branch *ret;
+    void *child;
+    int index,
+        slot,
+        i;
+
+    if (n == 0)
+        return BranchRetain(branch);
+
+    index = n;
+    slot = branch_slot(branch, height, &index);
+
+    ret = BranchNew();
+    child = NodeDrop(branch->slots[slot], height - 1, index);
+    BranchPushNode(ret, child, NodeSize(child, height - 1));
+    for (i = slot + 1; i < branch->length; i++)
+        BranchPushNode(ret,
+                       NodeRetain(branch->slots[i]),
+                       branch->size_table[i] - branch->size_table[i - 1]);
+    branch_update_dense(ret, height);
+
+    return ret;
+}
+
+void *
+BranchFirst(Branch *branch)
+{
+    return branch->slots[0];
+}
+
+void *
+BranchLast(Branch *branch)
+{
+    return branch->slots[branch->length - 1];
+}
+
+/*
+Push `child' as the last slot of `parent'. As the height of `parent' is not
+known here, it is flagged as relaxed past its first slot, callers that keep
+branches dense call branch_update_dense afterwards.
+*/
+
+bool
+BranchPushNode(Branch *parent, void *child, int child_len)
+{
+    if (parent->length == BRANCH_FACTOR)
+        return false;
+
+    parent->dense = parent->length == 0;
+    parent->slots[parent->length] = child;
+    if (parent->length == 0)
+        parent->size_table[0] = child_len;
+    else
+        parent->size_table[parent->length] =
+                parent->size_table[parent->length - 1] + child_len;
+    parent->length++;
+
+    return true;
+}
+
+/*
+Rebalance the leafs `leafs', the children of two neighbouring branches, and
+distribute them over (at most) two new branches. The leafs are only squashed
+when they are less compact than AVG_COMPACT allows. Leafs that are not
+squashed get shared with the new branches.
+*/
+
+branch_pair
+BranchLowConcat(Leaf **leafs, int num_nodes)
+{
+    int num_slots,
+        to_remove,
+        left_len,
+        right_len,
+        i;
+    Leaf *merged_leafs[2 * BRANCH_FACTOR];
+    branch_pair ret;
+
+    num_slots = 0;
+    for (i = 0; i < num_nodes; i++)
+        num_slots += leafs[i]->length;
+
+    assert(num_nodes <= 2 * BRANCH_FACTOR);
+    to_remove = compactness(num_nodes, num_slots, LEAF_FACTOR) - AVG_COMPACT;
+    if (to_remove < 0)
+        /* the leafs do not require compacting */
+        to_remove = 0;
+    merge_leafs(leafs, num_nodes, to_remove, merged_leafs);
+
+    /* unmarshall leafs to branch pair */
+    num_nodes -= to_remove;
+    right_len = num_nodes > BRANCH_FACTOR ? num_nodes - BRANCH_FACTOR : 0;
+    left_len = num_nodes - right_len;
+    if (left_len)
+    {
+        ret.left = BranchNew();
+        for (i = 0; i < left_len; i++)
+            BranchPushNode(ret.left, merged_leafs[i], merged_leafs[i]->length);
+
+        if (right_len)
+        {
+            ret.right = BranchNew();
+            for (i = 0; i < right_len; i++)
+                BranchPushNode(ret.right,
+                               merged_leafs[left_len + i],
+                               merged_leafs[left_len + i]->length);
+        }
+        else
+            ret.right = NULL;
+    }
+    else
+        ret.left = ret.right = NULL;
+
+    return ret;
+}
+
+/*
+Same as BranchLowConcat, for the branches one level up. The `height' of the
+branches is needed to flag the squashed ones dense where they are.
+*/
+
+branch_pair
+BranchHighConcat(Branch **branches, int num_nodes, int height)
+{
+    int num_slots,
+        to_remove,
+        left_len,
+        right_len,
+        i;
+    Branch *merged_branches[2 * BRANCH_FACTOR];
+    branch_pair ret;
+
+    num_slots = 0;
+    for (i = 0; i < num_nodes; i++)
+        num_slots += branches[i]->length;
+
+    assert(num_nodes <= 2 * BRANCH_FACTOR);
+    to_remove = compactness(num_nodes, num_slots, BRANCH_FACTOR) - AVG_COMPACT;
+    if (to_remove < 0)
+        to_remove = 0;
+    merge_branches(branches, num_nodes, to_remove, merged_branches, height);
+
+    num_nodes -= to_remove;
+    right_len = num_nodes > BRANCH_FACTOR ? num_nodes - BRANCH_FACTOR : 0;
+    left_len = num_nodes - right_len;
+    if (left_len)
+    {
+        ret.left = BranchNew();
+        for (i = 0; i < left_len; i++)
+            BranchPushNode(ret.left,
+                           merged_branches[i],
+                           BranchSize(merged_branches[i]));
+
+        if (right_len)
+        {
+            ret.right = BranchNew();
+            for (i = 0; i < right_len; i++)
+                BranchPushNode(ret.right,
+                               merged_branches[left_len + i],
+                               BranchSize(merged_branches[left_len + i]));
+        }
+        else
+            ret.right = NULL;
+    }
+    else
+        ret.left = ret.right = NULL;
+
+    return ret;
+}
+
+/*
+Concatenate the subtrees `left' and `right', which can be of different
+heights. The result is a branch one level above the taller of the two, holding
+the one or two branches the nodes along the seam were rebalanced into:
+
+                   left                            right
+                ┌──┬──┬──┐                      ┌──┬──┐
+                │ a│ b│ c│                      │ d│ e│
+                └──┴──┴─┬┘                      └┬─┴──┘
+                        └─────────┐    ┌─────────┘
+                                ┌─┴──┬─┴┐
+                     middle     │ c' │d'│  concat of `c' and `d'
+                                └────┴──┘
+
+The children of `left' but its last, the children of the middle, and the
+children of `right' but its first, are then rebalanced together. As
+`left' is descended along its right spine and `right' along its left spine,
+there are only O(log n) nodes to rebalance.
+*/
+
+Branch *
+concat_sub_tree(void *left, int left_height, void *right, int right_height)
+{
+    void *nodes[2 * BRANCH_FACTOR];
+    int num_nodes,
+        height,
+        i;
+    Branch *middle,
+           *ret;
+    branch_pair pair;
+
+    if (left_height == 0 && right_height == 0)
+    {   /* Two leafs, which always fit in a single branch */
+        nodes[0] = left;
+        nodes[1] = right;
+        pair = BranchLowConcat((Leaf **)nodes, 2);
+        branch_update_dense(pair.left, 1);
+        return pair.left;
+    }
+
+    height = left_height > right_height ? left_height : right_height;
+    if (left_height == right_height)
+        middle = concat_sub_tree(BranchLast(left), left_height - 1,
+                                 BranchFirst(right), right_height - 1);
+    else if (left_height > right_height)
+        middle = concat_sub_tree(BranchLast(left), left_height - 1,
+                                 right, right_height);
+    else
+        middle = concat_sub_tree(left, left_height,
+                                 BranchFirst(right), right_height - 1);
+
+    /* marshall nodes to array */
+    num_nodes = 0;
+    if (left_height == height)
+        for (i = 0; i < ((Branch *)left)->length - 1; i++)
+            nodes[num_nodes++] = ((Branch *)left)->slots[i];
+    for (i = 0; i < middle->length; i++)
+        nodes[num_nodes++] = middle->slots[i];
+    if (right_height == height)
+        for (i = 1; i < ((Branch *)right)->length; i++)
+            nodes[num_nodes++] = ((Branch *)right)->slots[i];
+
+    if (height == 1)
+        pair = BranchLowConcat((Leaf **)nodes, num_nodes);
+    else
+        pair = BranchHighConcat((Branch **)nodes, num_nodes, height - 1);
+    BranchRelease(middle, height);
+
+    branch_update_dense(pair.left, height);
+    ret = BranchNew();
+    BranchPushNode(ret, pair.left, BranchSize(pair.left));
+    if (pair.right)
+    {
+        branch_update_dense(pair.right, height);
+        BranchPushNode(ret, pair.right, BranchSize(pair.right));
+    }
+    branch_update_dense(ret, height + 1);
+
+    return ret;
+}
+
+/* TREE */
+
+/*
+Hand out a fresh edit token, tokens are never reused so that nodes tagged by a
+transient that has since been made persistent can never be owned again.
+*/
+
+int
+edit_new(void)
+{
+    static int last_edit;
+
+    return __atomic_add_fetch(&last_edit, 1, __ATOMIC_RELAXED);
+}
+
+Tree *
+TreeNew(void)
+{
+    Tree *tree;
+
+    tree = node_alloc(sizeof(Tree));
+    tree->edit = edit_new();
+
+    return tree;
+}
+
+/*
+The focus of a transient tree is the path from the root down to the leaf last
+read or written, along with the index of the first item under every branch on
+it. An access to the same leaf skips the descent entirely, an access close to
+it climbs the path only as far as the nearest branch holding its index and
+descends from there. The focus is dropped whenever the trie changes, and only
+a transient, which a single thread owns, moves it, so that reading a
+persistent tree never writes to it. A transient gets its focus when it is
+made transient or writes to its trie, and gives it back when it is made
+persistent, so that reads never allocate.
+*/
+
+typedef struct tree_focus tree_focus;
+
+struct tree_focus
+{
+    Leaf *leaf;
+    int start;
+    int miss;
+    Branch *path[TREE_MAX_HEIGHT];
+    int starts[TREE_MAX_HEIGHT];
+};
+
+void
+focus_reset(Tree *tree)
+{
+    if (tree->focus)
+        tree->focus->leaf = NULL;
+}
+
+void
+focus_attach(Tree *tree)
+{
+    if (tree->edit && tree->focus == NULL)
+        tree->focus = node_alloc(sizeof(tree_focus));
+}
+
+void
+focus_free(Tree *tree)
+{
+    if (tree->focus)
+        node_free(tree->focus, sizeof(tree_focus));
+    tree->focus = NULL;
+}
+
+/*
+Whether the focus should move to `index', which is outside the focused leaf.
+It does once a second access lands within a leaf of the first one that did
+not move it, so that a scan or a jump followed by accesses around it
+refocuses there, while random accesses keep on using the plain lookup
+rather than paying for moving the focus each time.
+*/
+
+bool
+focus_follow(Tree *tree, int index)
+{
+    tree_focus *focus;
+
+    focus = tree->focus;
+    if (focus == NULL)
+        return false;
+
+    if ((unsigned)(index - focus->miss + LEAF_FACTOR) < 2u * LEAF_FACTOR)
+        return true;
+    focus->miss = index;
+
+    return false;
+}
+
+/*
+Point the focus of `tree' at the leaf holding `index', which is in the trie,
+and return that leaf.
+*/
+
+Leaf *
+focus_locate(Tree *tree, int index)
+{
+    tree_focus *focus;
+    void *node;
+    int level,
+        sub;
+
+    focus = tree->focus;
+    focus->start = 0;
+    if (tree->height == 0)
+        return focus->leaf = tree->root;
+
+    assert(tree->height <= TREE_MAX_HEIGHT);
+    level = 0;
+    if (focus->leaf)
+        for (level = tree->height - 1; level > 0; level--)
+            if (index >= focus->starts[level] &&
+                index - focus->starts[level] < BranchSize(focus->path[level]))
+                break;
+    if (level == 0)
+    {
+        focus->path[0] = tree->root;
+        focus->starts[0] = 0;
+    }
+
+    sub = index - focus->starts[level];
+    while (true)
+    {
+        node = branch_step(focus->path[level], tree->height - level, &sub);
+        if (++level == tree->height)
+            break;
+        focus->path[level] = node;
+        focus->starts[level] = index - sub;
+    }
+
+    focus->start = index - sub;
+    return focus->leaf = node;
+}
+
+/*
+Whether the focused path is owned by `tree' alone, so that its leaf can be
+updated in place without descending to it. This holds for as long as no
+other tree shares any node on the path, whose count would then be above 1.
+*/
+
+bool
+focus_owned(const Tree *tree)
+{
+    const tree_focus *focus;
+    int level;
+
+    focus = tree->focus;
+    if (focus->leaf->edit != tree->edit || REFS_LOAD(focus->leaf->refs) != 1)
+        return false;
+    for (level = 0; level < tree->height; level++)
+        if (focus->path[level]->edit != tree->edit
+                || REFS_LOAD(focus->path[level]->refs) != 1)
+            return false;
+
+    return true;
+}
+
+void
+TreeHeighten(Tree *tree)
+{
+    Branch *branch;
+
+    assert(tree->map == NULL);
+    branch = BranchNew();
+    branch->edit = tree->edit;
+    branch->dense = true;
+    branch->length = 1;
+    branch->size_table[0] = NodeSize(tree->root, tree->height);
+    branch->slots[0] = tree->root;
+
+    tree->height++;
+    tree->root = branch;
+    focus_reset(tree);
+}
+
+int
+tail_offset(const Tree *tree)
+{
+    return tree->tail ? tree->length - tree->tail->length : tree->length;
+}
+
+int
+head_length(const Tree *tree)
+{
+    return tree->head ? tree->head->length : 0;
+}
+
+/*
+The items of the head, which fill its slots from the last one down.
+*/
+
+Elem *
+head_items(Leaf *head)
+{
+    return head->slots + LEAF_FACTOR - head->length;
+}
+
+/*
+Return a head owned by `edit' holding the `length' items of `items'.
+*/
+
+Leaf *
+head_new(const Elem *items, int length, int edit)
+{
+    Leaf *head;
+
+    head = LeafNew();
+    head->edit = edit;
+    head->length = length;
+    memcpy(head_items(head), items, length * sizeof(Elem));
+
+    return head;
+}
+
+/*
+Turn `leaf' into a head, and the other way around, by moving its items to the
+other end of its slots. Both give up the reference to the leaf they are given.
+A full leaf is laid out the same either way and is returned as it is.
+*/
+
+Leaf *
+leaf_to_head(Leaf *leaf, int edit)
+{
+    Leaf *head;
+
+    if (leaf->length == LEAF_FACTOR)
+        return leaf;
+
+    head = head_new(leaf->slots, leaf->length, edit);
+    LeafRelease(leaf);
+
+    return head;
+}
+
+Leaf *
+head_to_leaf(Leaf *head, int edit)
+{
+    Leaf *leaf;
+
+    if (head->length == LEAF_FACTOR)
+        return head;
+
+    leaf = LeafNew();
+    leaf->edit = edit;
+    LeafPushArray(leaf, head->length, head_items(head));
+    LeafRelease(head);
+
+    return leaf;
+}
+
+void
+TreePush(Tree *tree, Elem value)
+{
+    Leaf *tail;
+
+    assert(tree->map == NULL);
+    tail = tree->tail;
+    if (tail && tail->length != LEAF_FACTOR)
+    {   /* Fast path, there is room left in the tail */
+        tree->tail = tail = LeafEditable(tail, tree->edit);
+        tail->slots[tail->length++] = value;
+        tree->length++;
+        return;
+    }
+
+    if (tail)
+        TreePushLeaf(tree, tail);
+    tree->tail = LeafNew();
+    tree->tail->edit = tree->edit;
+    LeafPush(tree->tail, value);
+    tree->length++;
+}
+
+/*
+Push `leaf' as the new rightmost leaf of the trie. This does not change the
+length of the tree, as the items of `leaf' are expected to already be accounted
+for (i.e. they come from the tail).
+*/
+
+void
+TreePushLeaf(Tree *tree, Leaf *leaf)
+{
+    Branch *new_root;
+
+    assert(tree->map == NULL);
+    focus_reset(tree);
+    focus_attach(tree);
+    if (tree->root == NULL)
+    {
+        tree->root = leaf;
+        tree->height = 0;
+        return;
+    }
+
+    new_root = tree->height ?
+               BranchConjLeaf(tree->root, tree->edit, tree->height, leaf) :
+               NULL;
+    if (new_root)
+        tree->root = new_root;
+    else
+    {   /* Could not push leaf in current root node, heighten tree */
+        TreeHeighten(tree);
+        BranchPushNode(tree->root,
+                       BranchPathTo(leaf, tree->edit, tree->height - 1),
+                       leaf->length);
+        branch_update_dense(tree->root, tree->height);
+    }
+}
+
+/*
+Move the items of the tail into the trie, leaving the tree without a tail.
+*/
+
+void
+TreeFlushTail(Tree *tree)
+{
+    assert(tree->map == NULL);
+    if (tree->tail == NULL)
+        return;
+
+    if (tree->tail->length)
+        TreePushLeaf(tree, tree->tail);
+    tree->tail = NULL;
+}
+
+/*
+Push `leaf' as the new leftmost leaf of the trie, the items of which are
+accounted for like in TreePushLeaf.
+*/
+
+void
+tree_cons_leaf(Tree *tree, Leaf *leaf)
+{
+    Branch *new_root;
+
+    focus_reset(tree);
+    if (tree->root == NULL)
+    {
+        tree->root = leaf;
+        tree->height = 0;
+        return;
+    }
+
+    new_root = tree->height ?
+               BranchConsLeaf(tree->root, tree->edit, tree->height, leaf) :
+               NULL;
+    if (new_root == NULL)
+    {   /* The new root has room left of its only slot */
+        TreeHeighten(tree);
+        new_root = BranchConsLeaf(tree->root, tree->edit, tree->height, leaf);
+    }
+    tree->root = new_root;
+}
+
+/*
+Move the items of the head into the trie, leaving the tree without a head.
+*/
+
+void
+tree_flush_head(Tree *tree)
+{
+    if (tree->head == NULL)
+        return;
+
+    tree_cons_leaf(tree, head_to_leaf(tree->head, tree->edit));
+    tree->head = NULL;
+}
+
+/*
+Remove the branches with a single slot from the top of the trie, as they are
+left behind by slicing and popping.
+*/
+
+void
+tree_shorten(Tree *tree)
+{
+    while (tree->height && ((Branch *)tree->root)->length == 1)
+    {
+        Branch *root;
+
+        root = tree->root;
+        tree->root = NodeRetain(root->slots[0]);
+        tree->height--;
+        BranchRelease(root, tree->height + 1);
+    }
+}
+
+/*
+Take the rightmost leaf out of the trie, which must not be empty. The trie
+loses the height the leaf no longer needs, so that it stays as shallow as it
+would be if the leaf had never been pushed.
+*/
+
+Leaf *
+tree_pop_last_leaf(Tree *tree)
+{
+    Leaf *leaf;
+
+    focus_reset(tree);
+    if (tree->height == 0)
+        leaf = tree->root;
+    else
+        tree->root = BranchPopLastLeaf(tree->root, tree->edit, tree->height,
+                                       &leaf);
+    if (tree->height == 0 || tree->root == NULL)
+    {
+        tree->root = NULL;
+        tree->height = 0;
+    }
+    tree_shorten(tree);
+
+    return leaf;
+}
+
+Leaf *
+tree_pop_first_leaf(Tree *tree)
+{
+    Leaf *leaf;
+
+    focus_reset(tree);
+    if (tree->height == 0)
+        leaf = tree->root;
+    else
+        tree->root = BranchPopFirstLeaf(tree->root, tree->edit, tree->height,
+                                        &leaf);
+    if (tree->height == 0 || tree->root == NULL)
+    {
+        tree->root = NULL;
+        tree->height = 0;
+    }
+    tree_shorten(tree);
+
+    return leaf;
+}
+
+/*
+Add `value' in front of the first item of `tree'. Like TreePush this only
+touches the trie once every LEAF_FACTOR calls, when the full head is pushed
+into it as its new leftmost leaf.
+*/
+
+void
+TreePrepend(Tree *tree, Elem value)
+{
+    Leaf *head;
+
+    assert(tree->map == NULL);
+    head = tree->head;
+    if (head && head->length != LEAF_FACTOR)
+    {   /* Fast path, there is room left in the head */
+        tree->head = head = LeafEditable(head, tree->edit);
+        head->length++;
+        head_items(head)[0] = value;
+        tree->length++;
+        return;
+    }
+
+    if (head)
+        tree_cons_leaf(tree, head);
+    tree->head = head_new(&value, 1, tree->edit);
+    tree->length++;
+}
+
+/*
+Remove the last item of `tree', which must not be empty, and return it. Once
+the tail runs out the rightmost leaf of the trie takes its place, or the head
+when the trie is empty as well, so that every LEAF_FACTOR pops take out a
+whole leaf and the empty branches above it.
+*/
+
+Elem
+TreePop(Tree *tree)
+{
+    Leaf *tail;
+    Elem value;
+
+    assert(tree->length > 0 && tree->map == NULL);
+    if (tree->tail == NULL)
+    {
+        if (tree->root)
+            tree->tail = tree_pop_last_leaf(tree);
+        else
+        {
+            tree->tail = head_to_leaf(tree->head, tree->edit);
+            tree->head = NULL;
+        }
+    }
+
+    tree->tail = tail = LeafEditable(tree->tail, tree->edit);
+    value = tail->slots[--tail->length];
+    tree->length--;
+    if (tail->length == 0)
+    {
+        LeafRelease(tail);
+        tree->tail = NULL;
+    }
+
+    return value;
+}
+
+/*
+Remove the first item of `tree', which must not be empty, and return it, the
+mirror image of TreePop.
+*/
+
+Elem
+TreePopFront(Tree *tree)
+{
+    Leaf *head;
+    Elem value;
+
+    assert(tree->length > 0 && tree->map == NULL);
+    if (tree->head == NULL)
+    {
+        if (tree->root)
+            tree->head = leaf_to_head(tree_pop_first_leaf(tree), tree->edit);
+        else
+        {
+            tree->head = leaf_to_head(tree->tail, tree->edit);
+            tree->tail = NULL;
+        }
+    }
+
+    tree->head = head = LeafEditable(tree->head, tree->edit);
+    value = head_items(head)[0];
+    head->length--;
+    tree->length--;
+    if (head->length == 0)
+    {
+        LeafRelease(head);
+        tree->head = NULL;
+    }
+
+    return value;
+}
+
+Elem
+TreeGet(Tree *tree, int index)
+{
+    const tree_focus *focus;
+    int offset;
+
+    assert(index < tree->length);
+    offset = tail_offset(tree);
+    if (index >= offset)
+        return LeafGet(tree->tail, index - offset);
+    if (tree->head)
+    {
+        if (index < tree->head->length)
+            return head_items(tree->head)[index];
+        index -= tree->head->length;
+    }
+
+    focus = tree->focus;
+    if (focus && focus->leaf
+            && (unsigned)(index - focus->start) < (unsigned)focus->leaf->length)
+        return focus->leaf->slots[index - focus->start];
+    if (tree->map)
+        return mapped_get(tree->map, tree->root, tree->height, index);
+    if (tree->edit && focus_follow(tree, index))
+        return focus_locate(tree, index)->slots[index - tree->focus->start];
+
+    return trie_get(tree->root, tree->height, index);
+}
+
+void
+TreeSet(Tree *tree, int index, Elem value)
+{
+    tree_focus *focus;
+    Leaf *leaf;
+    int offset;
+
+    assert(index < tree->length && tree->map == NULL);
+    offset = tail_offset(tree);
+    if (index >= offset)
+    {
+        tree->tail = LeafAssoc(tree->tail, tree->edit, index - offset, value);
+        return;
+    }
+    if (tree->head)
+    {
+        if (index < tree->head->length)
+        {
+            tree->head = LeafAssoc(tree->head, tree->edit,
+                                   LEAF_FACTOR - tree->head->length + index,
+                                   value);
+            return;
+        }
+        index -= tree->head->length;
+    }
+
+    focus_attach(tree);
+    focus = tree->focus;
+    if (focus && focus->leaf
+            && (unsigned)(index - focus->start) < (unsigned)focus->leaf->length)
+        leaf = focus->leaf;
+    else if (tree->edit && focus_follow(tree, index))
+        leaf = focus_locate(tree, index);
+    else
+        leaf = NULL;
+
+    if (leaf && tree->edit && focus_owned(tree))
+    {
+        leaf->slots[index - tree->focus->start] = value;
+        return;
+    }
+
+    /* The path gets copied, which the focus then has to find */
+    tree->root = NodeAssoc(tree->root, tree->edit, tree->height, index, value);
+    focus_reset(tree);
+}
+
+/*
+The persistent API: instead of updating `tree' in place, these return a new
+persistent tree that differs from `tree' only along the root to leaf path of
+the change and shares every other node with it. Both trees remain valid and
+can be read from different threads, as a node is only ever updated in place
+by a transient owning it while no other node or tree refers to it.
+*/
+
+Tree *
+tree_clone(const Tree *tree, int edit)
+{
+    Tree *copy;
+
+    assert(tree->map == NULL);
+    copy = TreeNew();
+    *copy = *tree;
+    copy->edit = edit;
+    copy->focus = NULL;
+    if (copy->root)
+        NodeRetain(copy->root);
+    if (copy->head)
+        LeafRetain(copy->head);
+    if (copy->tail)
+        LeafRetain(copy->tail);
+
+    return copy;
+}
+
+Tree *
+TreeAssoc(const Tree *tree, int index, Elem value)
+{
+    Tree *new_tree;
+
+    new_tree = tree_clone(tree, 0);
+    TreeSet(new_tree, index, value);
+
+    return new_tree;
+}
+
+Tree *
+TreeConj(const Tree *tree, Elem value)
+{
+    Tree *new_tree;
+
+    new_tree = tree_clone(tree, 0);
+    TreePush(new_tree, value);
+
+    return new_tree;
+}
+
+/*
+Return a transient tree sharing all of its nodes with `tree'. As none of them
+is owned by the new edit token yet, the first update of each path copies it,
+after which updates along that path happen in place.
+*/
+
+Tree *
+TreeTransient(const Tree *tree)
+{
+    Tree *copy;
+
+    copy = tree_clone(tree, edit_new());
+    focus_attach(copy);
+
+    return copy;
+}
+
+/*
+Turn the transient `tree' persistent, its nodes can then be shared safely. Any
+further TreeSet or TreePush on it will copy the nodes it changes.
+*/
+
+Tree *
+TreePersistent(Tree *tree)
+{
+    tree->edit = 0;
+    focus_free(tree);
+    return tree;
+}
+
+/*
+Return a new tree holding the items of `left' followed by those of `right'.
+Both trees are left untouched, and share all but the O(log n) nodes along the
+seam with the result.
+*/
+
+Tree *
+TreeConcat(const Tree *left, const Tree *right)
+{
+    Tree *new_tree,
+         *flushed;
+    Branch *joined;
+    int height;
+
+    assert(left->map == NULL && right->map == NULL);
+    if (right->length == 0)
+        return tree_clone(left, edit_new());
+    if (left->length == 0)
+        return tree_clone(right, edit_new());
+    if (right->root == NULL)
+    {   /* Pushing the few items of `right' keeps the trie packed */
+        new_tree = tree_clone(left, edit_new());
+        if (right->head)
+            TreePushArray(new_tree, right->head->length,
+                          head_items(right->head));
+        if (right->tail)
+            TreePushArray(new_tree, right->tail->length, right->tail->slots);
+        return new_tree;
+    }
+
+    /* The tail of `left' and the head of `right' end up in the middle */
+    new_tree = tree_clone(left, 0);
+    TreeFlushTail(new_tree);
+    flushed = NULL;
+    if (right->head)
+    {
+        right = flushed = tree_clone(right, 0);
+        tree_flush_head(flushed);
+    }
+    new_tree->edit = edit_new();
+    new_tree->length += right->length;
+    new_tree->tail = right->tail ? LeafRetain(right->tail) : NULL;
+
+    if (new_tree->root == NULL)
+    {   /* `left' was all head */
+        new_tree->root = right->root ? NodeRetain(right->root) : NULL;
+        new_tree->height = right->height;
+    }
+    else if (right->root)
+    {
+        joined = concat_sub_tree(new_tree->root, new_tree->height,
+                                 right->root, right->height);
+        NodeRelease(new_tree->root, new_tree->height);
+
+        height = new_tree->height > right->height ?
+                 new_tree->height : right->height;
+        if (joined->length == 1)
+        {   /* Everything fit in a single node, no need to heighten the tree */
+            new_tree->root = NodeRetain(joined->slots[0]);
+            new_tree->height = height;
+            BranchRelease(joined, height + 1);
+        }
+        else
+        {
+            new_tree->root = joined;
+            new_tree->height = height + 1;
+        }
+    }
+
+    if (flushed)
+        TreeRelease(flushed);
+
+    return new_tree;
+}
+
+/*
+Return a new tree holding the items of the `n' trees in `trees' in order.
+Folding TreeConcat over them would join every tree to an ever taller result,
+each time along its whole right spine. Joining the two halves of the array
+instead, each built the same way, keeps both sides of every join of similar
+size, so that the n - 1 joins only cost O(log n) each and the seams are
+balanced throughout. The trees are left untouched.
+*/
+
+Tree *
+TreeConcatMany(Tree **trees, int n)
+{
+    Tree *left,
+         *right,
+         *ret;
+
+    if (n == 0)
+        return TreeNew();
+    if (n == 1)
+        return tree_clone(trees[0], edit_new());
+
+    left = TreeConcatMany(trees, n / 2);
+    right = TreeConcatMany(trees + n / 2, n - n / 2);
+    ret = TreeConcat(left, right);
+    TreeRelease(left);
+    TreeRelease(right);
+
+    return ret;
+}
+
+/*
+Move the rightmost leaf of the trie into the empty tail, so that pushes on a
+sliced tree start out filling the tail rather than a new leaf.
+*/
+
+void
+tree_pull_tail(Tree *tree)
+{
+    if (tree->tail || tree->root == NULL)
+        return;
+
+    tree->tail = tree_pop_last_leaf(tree);
+}
+
+/*
+Slicing returns new trees sharing every node with `tree' but the ones along the
+root to leaf paths of the cuts, which makes it O(log n).
+*/
+
+Tree *
+TreeTake(const Tree *tree, int n)
+{
+    Tree *new_tree;
+    int head_len,
+        offset;
+
+    assert(n >= 0 && n <= tree->length && tree->map == NULL);
+    new_tree = TreeNew();
+    new_tree->length = n;
+    if (n == 0)
+        return new_tree;
+
+    head_len = head_length(tree);
+    if (n <= head_len)
+    {   /* The cut is in the head, which is all that is left */
+        new_tree->tail = LeafNew();
+        new_tree->tail->edit = new_tree->edit;
+        LeafPushArray(new_tree->tail, n, head_items(tree->head));
+        return new_tree;
+    }
+
+    new_tree->head = tree->head ? LeafRetain(tree->head) : NULL;
+    offset = tail_offset(tree);
+    if (n > offset)
+    {   /* The cut is in the tail */
+        new_tree->height = tree->height;
+        new_tree->root = tree->root ? NodeRetain(tree->root) : NULL;
+        new_tree->tail = LeafTake(tree->tail, n - offset);
+        if (new_tree->tail != tree->tail)
+            new_tree->tail->edit = new_tree->edit;
+    }
+    else
+    {
+        new_tree->height = tree->height;
+        new_tree->root = NodeTake(tree->root, tree->height, n - head_len);
+        tree_shorten(new_tree);
+        tree_pull_tail(new_tree);
+    }
+
+    return new_tree;
+}
+
+Tree *
+TreeDrop(const Tree *tree, int n)
+{
+    Tree *new_tree;
+    int head_len,
+        offset;
+
+    assert(n >= 0 && n <= tree->length && tree->map == NULL);
+    new_tree = TreeNew();
+    new_tree->length = tree->length - n;
+    if (new_tree->length == 0)
+        return new_tree;
+
+    head_len = head_length(tree);
+    if (n < head_len)
+    {   /* The cut is in the head, the trie and tail are kept whole */
+        new_tree->head = head_new(head_items(tree->head) + n, head_len - n,
+                                  new_tree->edit);
+        new_tree->height = tree->height;
+        new_tree->root = tree->root ? NodeRetain(tree->root) : NULL;
+        new_tree->tail = tree->tail ? LeafRetain(tree->tail) : NULL;
+        return new_tree;
+    }
+
+    offset = tail_offset(tree);
+    if (n >= offset)
+    {   /* The cut is in the tail, nothing is left of the trie */
+        new_tree->tail = LeafDrop(tree->tail, n - offset);
+        if (new_tree->tail != tree->tail)
+            new_tree->tail->edit = new_tree->edit;
+    }
+    else
+    {
+        new_tree->height = tree->height;
+        new_tree->root = NodeDrop(tree->root, tree->height, n - head_len);
+        new_tree->tail = tree->tail ? LeafRetain(tree->tail) : NULL;
+        tree_shorten(new_tree);
+        tree_pull_tail(new_tree);
+    }
+
+    return new_tree;
+}
+
+/*
+Return the items of `tree' from index `from' up to, but excluding, `to'.
+*/
+
+Tree *
+TreeSlice(const Tree *tree, int from, int to)
+{
+    Tree *taken,
+         *ret;
+
+    assert(from <= to);
+    taken = TreeTake(tree, to);
+    ret = TreeDrop(taken, from);
+    TreeRelease(taken);
+
+    return ret;
+}
+
+void
+TreeSplitAt(const Tree *tree, int index, Tree **left, Tree **right)
+{
+    *left = TreeTake(tree, index);
+    *right = TreeDrop(tree, index);
+}
+
+/*
+Make `tree' hold the items of `ret' instead of its own, and free `ret'. A
+transient keeps its edit token, so that the nodes it shares with `ret' stay
+owned by it once its old root is released, and only the nodes `ret' built
+get copied on their next edit.
+*/
+
+void
+tree_replace(Tree *tree, Tree *ret)
+{
+    if (tree->root)
+        NodeRelease(tree->root, tree->height);
+    if (tree->head)
+        LeafRelease(tree->head);
+    if (tree->tail)
+        LeafRelease(tree->tail);
+    focus_reset(tree);
+    tree->length = ret->length;
+    tree->root = ret->root;
+    tree->height = ret->height;
+    tree->head = ret->head;
+    tree->tail = ret->tail;
+    focus_free(ret);
+    node_free(ret, sizeof(Tree));
+}
+
+/*
+The leaf of the trie under `node' holding `*index', which is rebased into it,
+and the branch above that leaf in `*parent', or NULL when `node' is the leaf.
+*/
+
+Leaf *
+trie_leaf(void *node, int height, int *index, Branch **parent)
+{
+    *parent = NULL;
+    for (; height; height--)
+    {
+        *parent = node;
+        node = (*parent)->slots[branch_slot(*parent, height, index)];
+    }
+
+    return node;
+}
+
+/*
+Whether inserting `arr_len' items under `root', a branch of `height', in front
+of item `index' keeps every branch it changes within AVG_COMPACT of the fewest
+slots its children fit in. The items go in the leaf holding that item if it
+has room, else in the leafs of its parent if they have room. Otherwise the
+leaf is split, and so is every full branch above it, up to the first one
+with a free slot, or the root.
+*/
+
+bool
+trie_can_insert(Branch *root, int height, int index, int arr_len)
+{
+    Branch *path[TREE_MAX_HEIGHT + 1];
+    Leaf *leaf;
+    int children,
+        h,
+        i;
+
+    for (h = height; h > 0; h--)
+    {
+        path[h] = h == height ? root :
+                  path[h + 1]->slots[branch_slot(path[h + 1], h + 1, &index)];
+    }
+    leaf = path[1]->slots[branch_slot(path[1], 1, &index)];
+    if (leaf->length + arr_len <= LEAF_FACTOR)
+        return true;
+    if (arr_len > LEAF_FACTOR)
+        return false;
+    if (BranchSize(path[1]) + arr_len <= path[1]->length * LEAF_FACTOR)
+        return true;
+    if (path[1]->length < BRANCH_FACTOR)
+        return compactness(path[1]->length + 1,
+                           BranchSize(path[1]) + arr_len,
+                           LEAF_FACTOR) <= AVG_COMPACT;
+
+    for (h = 2; h <= height; h++)
+    {
+        if (path[h]->length == BRANCH_FACTOR)
+            continue;
+
+        children = 1;
+        for (i = 0; i < path[h]->length; i++)
+            children += ((Branch *)path[h]->slots[i])->length;
+        return compactness(path[h]->length + 1, children,
+                           BRANCH_FACTOR) <= AVG_COMPACT;
+    }
+
+    return true;
+}
+
+/*
+Insert the items of `arr' in front of item `index' of `tree' where they fit
+without rebuilding it: in the head or the tail if they have room for them,
+or in the trie where trie_can_insert allows. Returns false, leaving `tree'
+as it is, otherwise.
+*/
+
+bool
+tree_insert_in_place(Tree *tree, int index, int arr_len, const Elem *arr)
+{
+    Branch *root,
+           *split;
+    Leaf *head;
+    Elem *items;
+    int head_len,
+        offset;
+
+    head_len = head_length(tree);
+    offset = tail_offset(tree);
+    if (index <= head_len && head_len + arr_len <= LEAF_FACTOR)
+    {
+        if (tree->head == NULL)
+            tree->head = head_new(arr, arr_len, tree->edit);
+        else
+        {   /* Move the items in front of `index' down to make room */
+            tree->head = head = LeafEditable(tree->head, tree->edit);
+            items = head_items(head);
+            memmove(items - arr_len, items, index * sizeof(Elem));
+            memcpy(items - arr_len + index, arr, arr_len * sizeof(Elem));
+            head->length += arr_len;
+        }
+    }
+    else if (index >= offset && tree->tail
+            && tree->tail->length + arr_len <= LEAF_FACTOR)
+        tree->tail = LeafInsert(tree->tail, tree->edit, index - offset,
+                                arr_len, arr);
+    else if (index >= head_len && index < offset && tree->height > 0
+            && trie_can_insert(tree->root, tree->height,
+                               index - head_len, arr_len))
+    {
+        focus_reset(tree);
+        tree->root = BranchInsert(tree->root, tree->edit, tree->height,
+                                  index - head_len, arr_len, arr, &split);
+        if (split)
+        {   /* The root itself was split, grow the trie by one level */
+            root = BranchNew();
+            root->edit = tree->edit;
+            BranchPushNode(root, tree->root,
+                           NodeSize(tree->root, tree->height));
+            BranchPushNode(root, split, NodeSize(split, tree->height));
+            tree->height++;
+            branch_update_dense(root, tree->height);
+            tree->root = root;
+        }
+        tree_shorten(tree);
+    }
+    else if (index >= head_len && index < offset && tree->height == 0
+            && ((Leaf *)tree->root)->length + arr_len <= LEAF_FACTOR)
+    {
+        focus_reset(tree);
+        tree->root = LeafInsert(tree->root, tree->edit, index - head_len,
+                                arr_len, arr);
+    }
+    else
+        return false;
+
+    tree->length += arr_len;
+    return true;
+}
+
+/*
+Remove the items of `tree' from `from' up to `to' if they are all in a single
+leaf. A leaf of the trie also has to keep at least one item, and its parent
+has to stay within AVG_COMPACT of the fewest leafs its items fit in.
+Returns false, leaving `tree' as it is, otherwise.
+*/
+
+bool
+tree_remove_in_place(Tree *tree, int from, int to)
+{
+    Branch *parent;
+    Leaf *head,
+         *leaf;
+    Elem *items;
+    int head_len,
+        offset,
+        removed,
+        sub;
+
+    removed = to - from;
+    head_len = head_length(tree);
+    offset = tail_offset(tree);
+    if (to <= head_len)
+    {   /* Move the items in front of `from' up over the removed ones */
+        tree->head = head = LeafEditable(tree->head, tree->edit);
+        items = head_items(head);
+        memmove(items + removed, items, from * sizeof(Elem));
+        head->length -= removed;
+        if (head->length == 0)
+        {
+            LeafRelease(head);
+            tree->head = NULL;
+        }
+    }
+    else if (from >= offset)
+    {
+        tree->tail = LeafRemove(tree->tail, tree->edit,
+                                from - offset, to - offset);
+        if (tree->tail->length == 0)
+        {
+            LeafRelease(tree->tail);
+            tree->tail = NULL;
+        }
+    }
+    else if (from >= head_len && to <= offset)
+    {
+        sub = from - head_len;
+        leaf = trie_leaf(tree->root, tree->height, &sub, &parent);
+        if (sub + removed > leaf->length || removed == leaf->length)
+            return false;
+        if (parent && compactness(parent->length,
+                                  BranchSize(parent) - removed,
+                                  LEAF_FACTOR) > AVG_COMPACT)
+            return false;
+
+        focus_reset(tree);
+        tree->root = NodeRemove(tree->root, tree->edit, tree->height,
+                                from - head_len, to - head_len);
+    }
+    else
+        return false;
+
+    tree->length -= removed;
+    return true;
+}
+
+/*
+Merge the children of the branches around item `index' of `tree', where it
+was joined back together, that are less compact than AVG_COMPACT allows,
+see branch_compact_path. Both paths next to the seam are checked.
+*/
+
+void
+tree_compact_seam(Tree *tree, int index)
+{
+    int head_len,
+        sub,
+        i;
+
+    head_len = head_length(tree);
+    for (i = index - 1; i <= index; i++)
+    {
+        if (tree->height == 0)
+            return;
+
+        /* A seam next to the head or tail is at the edge of the trie */
+        sub = i - head_len;
+        if (sub < 0)
+            sub = 0;
+        if (sub >= BranchSize(tree->root))
+            sub = BranchSize(tree->root) - 1;
+        if (!branch_path_loose(tree->root, tree->height, sub))
+            continue;
+
+        focus_reset(tree);
+        tree->root = branch_compact_path(tree->root, tree->edit,
+                                         tree->height, sub);
+        tree_shorten(tree);
+    }
+}
+
+/*
+Editing in the middle of a tree changes the leaf holding the edit, its
+neighbours under the same parent, or splits it and the full branches above
+it B-tree style, updating the size tables along the way, which is O(log n).
+Where that would leave a branch less compact than AVG_COMPACT allows, the
+tree is split at the edit and joined back together around it instead, which
+rebalances the leafs and branches along the seam like any concatenation, and
+is O(log n) as well, plus the items inserted. The branches the cuts left
+along the seam are then merged back within AVG_COMPACT.
+*/
+
+void
+TreeInsertArrayAt(Tree *tree, int index, int arr_len, const Elem *arr)
+{
+    Tree *left,
+         *right,
+         *ret;
+
+    assert(index >= 0 && index <= tree->length && tree->map == NULL);
+    if (arr_len == 0)
+        return;
+    if (index == tree->length)
+    {
+        TreePushArray(tree, arr_len, arr);
+        return;
+    }
+    if (tree_insert_in_place(tree, index, arr_len, arr))
+        return;
+
+    left = TreeTake(tree, index);
+    TreePushArray(left, arr_len, arr);
+    right = TreeDrop(tree, index);
+    ret = TreeConcat(left, right);
+    TreeRelease(left);
+    TreeRelease(right);
+    tree_replace(tree, ret);
+    tree_compact_seam(tree, index);
+    tree_compact_seam(tree, index + arr_len);
+}
+
+void
+TreeInsertAt(Tree *tree, int index, Elem value)
+{
+    TreeInsertArrayAt(tree, index, 1, &value);
+}
+
+void
+TreeRemoveRange(Tree *tree, int from, int to)
+{
+    Tree *left,
+         *right,
+         *ret;
+
+    assert(from >= 0 && from <= to && to <= tree->length);
+    assert(tree->map == NULL);
+    if (from == to || tree_remove_in_place(tree, from, to))
+        return;
+
+    left = TreeTake(tree, from);
+    right = TreeDrop(tree, to);
+    ret = TreeConcat(left, right);
+    TreeRelease(left);
+    TreeRelease(right);
+    tree_replace(tree, ret);
+    tree_compact_seam(tree, from);
+}
+
+/*
+Remove item `index' of `tree' and return it.
+*/
+
+Elem
+TreeRemoveAt(Tree *tree, int index)
+{
+    Elem value;
+
+    value = TreeGet(tree, index);
+    TreeRemoveRange(tree, index, index + 1);
+
+    return value;
+}
+
+/*
+Return the number of items at the start of the trie of `tree' that are laid
+out as pushing them would have, i.e. in full leafs under branches flagged
+dense with full children only. `done' is set when that covers the whole trie
+but its last leaf, and every branch down to it is flagged dense.
+*/
+
+int
+compact_prefix(const Tree *tree, bool *done)
+{
+    Branch *branch;
+    Leaf *leaf;
+    void *node;
+    int height,
+        prefix,
+        size,
+        i;
+
+    *done = true;
+    if (tree->root == NULL)
+        return 0;
+
+    prefix = 0;
+    node = tree->root;
+    for (height = tree->height; height; height--)
+    {
+        branch = node;
+        size = level_shift(height) < (int)sizeof(int) * 8 - 1 ?
+               1 << level_shift(height) : INT_MAX;
+        for (i = 0; i < branch->length - 1; i++)
+        {
+            if (branch->size_table[i] - (i ? branch->size_table[i - 1] : 0)
+                    != size)
+                break;
+            if (height > 1 && !((Branch *)branch->slots[i])->dense)
+                break;
+            prefix += size;
+        }
+
+        if (i != branch->length - 1 || !branch->dense)
+            *done = false;
+        node = branch->slots[i];
+    }
+
+    leaf = node;
+    if (leaf->length == LEAF_FACTOR)
+        prefix += LEAF_FACTOR;
+
+    return prefix;
+}
+
+/*
+Repack the trie of `tree' a bit further towards the layout pushing its items
+would have given it, where every branch is dense and lookups never search a
+size table. The laid out prefix of the trie is taken, the next `budget'
+leafs worth of items are pushed on it, which packs them into full leafs, and
+the rest of the tree is concatenated back. Every call hence costs O(budget +
+log n), so that a long-lived tree can be compacted in slices, say from an
+idle loop. Returns true once there is nothing left to repack.
+*/
+
+bool
+TreeCompact(Tree *tree, int budget)
+{
+    Tree *prefix,
+         *rest,
+         *ret;
+    TreeIter iter;
+    const Elem *items;
+    bool done;
+    int offset,
+        start,
+        moved,
+        length;
+
+    assert(budget > 0 && tree->map == NULL);
+    /* Compacting starts from the front of the trie, where the head goes */
+    tree_flush_head(tree);
+    start = compact_prefix(tree, &done);
+    if (done)
+        return true;
+
+    offset = tail_offset(tree);
+    moved = offset - start;
+    if (moved > budget * LEAF_FACTOR)
+        moved = budget * LEAF_FACTOR;
+
+    /* BranchTake flags the copied path dense, the rest is flagged already */
+    prefix = TreeTake(tree, start);
+
+    TreeIterInit(&iter, tree);
+    TreeIterSeek(&iter, start);
+    for (length = 0; moved > 0; moved -= length)
+    {
+        TreeIterNext(&iter, &items, &length);
+        if (length > moved)
+            length = moved;
+        TreePushArray(prefix, length, items);
+    }
+
+    rest = TreeDrop(tree, prefix->length);
+    ret = TreeConcat(prefix, rest);
+    TreeRelease(prefix);
+    TreeRelease(rest);
+    tree_replace(tree, ret);
+
+    return false;
+}
+
+/*
+Free `tree', along with the nodes no other tree refers to. A tree mapped from
+a file is unmapped instead.
+*/
+
+void
+TreeRelease(Tree *tree)
+{
+    if (tree->map)
+        munmap((void *)tree->map, tree->map_size);
+    else
+    {
+        if (tree->root)
+            NodeRelease(tree->root, tree->height);
+        if (tree->head)
+            LeafRelease(tree->head);
+        if (tree->tail)
+            LeafRelease(tree->tail);
+    }
+    focus_free(tree);
+    node_free(tree, sizeof(Tree));
+}
+
+/*
+Push the items of `arr' a tail at a time, copying into the room left in the
+tail at once rather than item by item.
+*/
+
+void
+TreePushArray(Tree *tree, int arr_len, const Elem *arr)
+{
+    Leaf *tail;
+    int n;
+
+    assert(tree->map == NULL);
+    while (arr_len > 0)
+    {
+        tail = tree->tail;
+        if (tail == NULL || tail->length == LEAF_FACTOR)
+        {
+            TreePush(tree, *arr++);
+            arr_len--;
+            continue;
+        }
+
+        tree->tail = tail = LeafEditable(tail, tree->edit);
+        n = tail->length;
+        LeafPushArray(tail, arr_len, arr);
+        n = tail->length - n;
+        tree->length += n;
+        arr += n;
+        arr_len -= n;
+    }
+}
+
+/*
+Build a tree holding the items of `arr'.
+*/
+
+Tree *
+TreeFromArray(const Elem *arr, size_t arr_len)
+{
+    TreeBuilder builder;
+
+    TreeBuilderInit(&builder);
+    TreeBuilderPushArray(&builder, arr, arr_len);
+
+    return TreeBuilderFinish(&builder);
+}
+
+/*
+The builder only holds the levels it has opened so far, `levels[h - 1]'
+being the open branch at height h, or NULL after it was pushed up full.
+`leaf' is the leaf being filled, which ends up as the tail of the tree.
+*/
+
+void
+TreeBuilderInit(TreeBuilder *builder)
+{
+    builder->edit = edit_new();
+    builder->length = 0;
+    builder->height = 0;
+    builder->leaf = NULL;
+}
+
+/*
+Push the full `node' of height `height' into the open branch above it,
+carrying the branch on upwards if that fills it.
+*/
+
+void
+builder_push_node(TreeBuilder *builder, void *node, int height)
+{
+    Branch *branch;
+    int size;
+
+    size = 1 << level_shift(height + 1);
+    for (;;)
+    {
+        assert(height < TREE_MAX_HEIGHT);
+        if (height == builder->height)
+            builder->levels[builder->height++] = NULL;
+
+        branch = builder->levels[height];
+        if (branch == NULL)
+        {
+            branch = builder->levels[height] = BranchNew();
+            branch->edit = builder->edit;
+        }
+
+        BranchPushNode(branch, node, size);
+        branch->dense = true;
+        if (branch->length != BRANCH_FACTOR)
+            return;
+
+        builder->levels[height] = NULL;
+        node = branch;
+        height++;
+        size <<= SHIFT_BITS;
+    }
+}
+
+void
+TreeBuilderPush(TreeBuilder *builder, Elem value)
+{
+    TreeBuilderPushArray(builder, &value, 1);
+}
+
+/*
+Copy the items of `arr' into the builder a leaf at a time.
+*/
+
+void
+TreeBuilderPushArray(TreeBuilder *builder, const Elem *arr, size_t arr_len)
+{
+    Leaf *leaf;
+    int n;
+
+    assert(arr_len <= (size_t)(INT_MAX - builder->length));
+    while (arr_len > 0)
+    {
+        leaf = builder->leaf;
+        if (leaf == NULL || leaf->length == LEAF_FACTOR)
+        {
+            if (leaf)
+                builder_push_node(builder, leaf, 0);
+            leaf = builder->leaf = LeafNew();
+            leaf->edit = builder->edit;
+        }
+
+        n = LEAF_FACTOR - leaf->length;
+        if ((size_t)n > arr_len)
+            n = arr_len;
+
+        memcpy(leaf->slots + leaf->length, arr, n * sizeof(Elem));
+        leaf->length += n;
+        builder->length += n;
+        arr += n;
+        arr_len -= n;
+    }
+}
+
+/*
+Close the open branches bottom-up, each one becoming the last child of the
+level above, and return the transient tree they make up. The last leaf is
+left as its tail. The builder has to be initialized again before it is
+reused.
+*/
+
+Tree *
+TreeBuilderFinish(TreeBuilder *builder)
+{
+    Tree *tree;
+    Branch *branch;
+    void *node;
+    int height,
+        size;
+
+    tree = node_alloc(sizeof(Tree));
+    tree->edit = builder->edit;
+    tree->length = builder->length;
+    tree->tail = builder->leaf;
+
+    node = NULL;
+    size = 0;
+    for (height = 0; height < builder->height; height++)
+    {
+        branch = builder->levels[height];
+        if (node)
+        {
+            if (branch == NULL)
+            {
+                branch = BranchNew();
+                branch->edit = builder->edit;
+            }
+            BranchPushNode(branch, node, size);
+            branch->dense = true;
+        }
+
+        if (branch)
+        {
+            node = branch;
+            size = BranchSize(branch);
+            tree->height = height + 1;
+        }
+    }
+
+    /* A full top level was carried into a branch of its own */
+    while (tree->height && ((Branch *)node)->length == 1)
+    {
+        branch = node;
+        node = branch->slots[0];
+        node_free(branch, sizeof(Branch));
+        tree->height--;
+    }
+
+    tree->root = node;
+    builder->height = 0;
+    builder->leaf = NULL;
+
+    return tree;
+}
+
+/* ITER */
+
+/*
+The iterator is a cursor between two items: `index' is the item TreeIterNext
+returns first, TreeIterPrev returns the items before it. `leaf' is the leaf
+the path leads to, its first item being item `leaf_start' of the tree, or
+NULL until the cursor has been placed. The head counts as the leaf before the
+first one of the trie and the tail as the one after the last, no path is kept
+for either of them.
+
+        branches[0] = root       slots[0]
+        branches[1]              slots[1]
+        ...
+        branches[height - 1]     slots[height - 1]   -> leaf
+*/
+
+void
+TreeIterInit(TreeIter *iter, const Tree *tree)
+{
+    iter->tree = tree;
+    iter->index = 0;
+    iter->leaf_start = 0;
+    iter->leaf = NULL;
+}
+
+/*
+Move the cursor in front of item `index', which may be the length of the tree
+to iterate backwards from the end. The path is only rebuilt once the next
+leaf is asked for, and not at all if the index is in the current leaf.
+*/
+
+void
+TreeIterSeek(TreeIter *iter, int index)
+{
+    assert(index >= 0 && index <= iter->tree->length);
+    iter->index = index;
+}
+
+/*
+Fill the path below `level' down to a leaf, taking the first slot of every
+branch on the way, or the last when `last' is set. A level equal to the
+height of the tree only sets the leaf from the slot chosen at the bottom.
+*/
+
+void
+iter_descend(TreeIter *iter, int level, bool last)
+{
+    const Tree *tree;
+    void *node;
+
+    tree = iter->tree;
+    if (tree->height == 0)
+    {
+        iter->leaf = tree->root;
+        return;
+    }
+
+    if (level < 0)
+    {
+        iter->branches[0] = tree->root;
+        iter->slots[0] = last ? iter->branches[0]->length - 1 : 0;
+        level = 0;
+    }
+
+    for (; level < tree->height - 1; level++)
+    {
+        node = branch_child(tree->map, iter->branches[level],
+                            iter->slots[level]);
+        iter->branches[level + 1] = node;
+        iter->slots[level + 1] = last ? ((Branch *)node)->length - 1 : 0;
+    }
+
+    iter->leaf = branch_child(tree->map, iter->branches[level],
+                              iter->slots[level]);
+}
+
+/*
+Point the path at the leaf holding item `index', which is before the end of
+the tree.
+*/
+
+void
+iter_locate(TreeIter *iter, int index)
+{
+    const Tree *tree;
+    void *node;
+    int offset,
+        level;
+
+    tree = iter->tree;
+    offset = tail_offset(tree);
+    if (index >= offset)
+    {
+        iter->leaf = tree->tail;
+        iter->leaf_start = offset;
+        return;
+    }
+    if (index < head_length(tree))
+    {
+        iter->leaf = tree->head;
+        iter->leaf_start = 0;
+        return;
+    }
+
+    assert(tree->height <= TREE_MAX_HEIGHT);
+    iter->leaf_start = index;
+    index -= head_length(tree);
+    node = tree->root;
+    for (level = 0; level < tree->height; level++)
+    {
+        iter->branches[level] = node;
+        iter->slots[level] = branch_slot(node, tree->height - level, &index);
+        node = branch_child(tree->map, iter->branches[level],
+                            iter->slots[level]);
+    }
+
+    iter->leaf = node;
+    iter->leaf_start -= index;
+}
+
+/*
+Step the path from the current leaf to the one after it, climbing up to the
+lowest branch that has a slot right of the path. The first leaf of the trie
+comes after the head, and past the last one comes the tail.
+*/
+
+void
+iter_next_leaf(TreeIter *iter)
+{
+    const Tree *tree;
+    bool in_head;
+    int level;
+
+    tree = iter->tree;
+    in_head = iter->leaf_start == 0 && tree->head;
+    iter->leaf_start += iter->leaf->length;
+    if (iter->leaf_start >= tail_offset(tree))
+    {
+        iter->leaf = tree->tail;
+        return;
+    }
+    if (in_head)
+    {
+        iter_descend(iter, -1, false);
+        return;
+    }
+
+    for (level = tree->height - 1; level >= 0; level--)
+        if (iter->slots[level] + 1 < iter->branches[level]->length)
+            break;
+
+    iter->slots[level]++;
+    iter_descend(iter, level, false);
+}
+
+/*
+Step the path from the current leaf to the one before it, which for the tail
+is the last leaf of the trie, and for the first leaf of the trie the head.
+*/
+
+void
+iter_prev_leaf(TreeIter *iter)
+{
+    const Tree *tree;
+    int level;
+
+    tree = iter->tree;
+    if (iter->leaf_start == head_length(tree))
+    {
+        iter->leaf = tree->head;
+        iter->leaf_start = 0;
+        return;
+    }
+    if (iter->leaf == tree->tail && iter->leaf_start == tail_offset(tree))
+        iter_descend(iter, -1, true);
+    else
+    {
+        for (level = tree->height - 1; level >= 0; level--)
+            if (iter->slots[level] > 0)
+                break;
+
+        iter->slots[level]--;
+        iter_descend(iter, level, true);
+    }
+
+    iter->leaf_start -= iter->leaf->length;
+}
+
+/*
+The items of the leaf the cursor is in, the head keeps them at the end of its
+slots.
+*/
+
+const Elem *
+iter_items(const TreeIter *iter)
+{
+    if (iter->leaf_start == 0 && iter->tree->head)
+        return head_items(iter->leaf);
+
+    return iter->leaf->slots;
+}
+
+/*
+Yield the items from the cursor up to the end of its leaf through `items' and
+`length', and move the cursor past them. Returns false at the end of the tree.
+The items belong to the tree and must not be written to.
+*/
+
+bool
+TreeIterNext(TreeIter *iter, const Elem **items, int *length)
+{
+    int index;
+
+    index = iter->index;
+    if (index >= iter->tree->length)
+        return false;
+
+    if (iter->leaf == NULL
+            || index < iter->leaf_start
+            || index > iter->leaf_start + iter->leaf->length)
+        iter_locate(iter, index);
+    else if (index == iter->leaf_start + iter->leaf->length)
+        iter_next_leaf(iter);
+
+    *items = iter_items(iter) + (index - iter->leaf_start);
+    *length = iter->leaf_start + iter->leaf->length - index;
+    iter->index += *length;
+
+    return true;
+}
+
+/*
+Yield the items from the start of the leaf before the cursor up to the
+cursor, and move the cursor in front of them. Returns false at the start of
+the tree.
+*/
+
+bool
+TreeIterPrev(TreeIter *iter, const Elem **items, int *length)
+{
+    int index;
+
+    index = iter->index;
+    if (index <= 0)
+        return false;
+
+    if (iter->leaf == NULL
+            || index < iter->leaf_start
+            || index > iter->leaf_start + iter->leaf->length)
+        iter_locate(iter, index - 1);
+    else if (index == iter->leaf_start)
+        iter_prev_leaf(iter);
+
+    *items = iter_items(iter);
+    *length = index - iter->leaf_start;
+    iter->index = iter->leaf_start;
+
+    return true;
+}
+
+/* BULK */
+
+/*
+The bulk kernels go over each run of items a block of BULK_BLOCK items at a
+time, then over the items left one by one. The block loops have a constant
+trip count and no early exit, which is what lets the compiler vectorize them
+at -O2 already. Tests are counted with `+=' into an int rather than or'ed
+into a bool, which it does not vectorize.
+*/
+
+#define BULK_BLOCK 16
+
+enum elem_test
+{
+    TEST_EQUAL,                 /* item == lo */
+    TEST_LESS,                  /* item < lo */
+    TEST_BETWEEN                /* lo <= item <= hi */
+};
+
+static ElemSum
+bulk_sum(const Elem *items)
+{
+    ElemSum sum;
+    int i;
+
+    sum = 0;
+    for (i = 0; i < BULK_BLOCK; i++)
+        sum += items[i];
+
+    return sum;
+}
+
+static void
+bulk_minmax(const Elem *items, Elem *min, Elem *max)
+{
+    Elem lo,
+         hi;
+    int i;
+
+    lo = *min;
+    hi = *max;
+    for (i = 0; i < BULK_BLOCK; i++)
+    {
+        lo = items[i] < lo ? items[i] : lo;
+        hi = items[i] > hi ? items[i] : hi;
+    }
+
+    *min = lo;
+    *max = hi;
+}
+
+/*
+Return the number of items of the block passing `test'. The test is
+switched on once, each case being a loop of its own.
+*/
+
+static int
+bulk_count(const Elem *items, enum elem_test test, Elem lo, Elem hi)
+{
+    int count,
+        i;
+
+    count = 0;
+    switch (test)
+    {
+    case TEST_EQUAL:
+        for (i = 0; i < BULK_BLOCK; i++)
+            count += items[i] == lo;
+        break;
+    case TEST_LESS:
+        for (i = 0; i < BULK_BLOCK; i++)
+            count += items[i] < lo;
+        break;
+    case TEST_BETWEEN:
+        for (i = 0; i < BULK_BLOCK; i++)
+            count += (items[i] >= lo) & (items[i] <= hi);
+        break;
+    }
+
+    return count;
+}
+
+static inline bool
+elem_passes(Elem item, enum elem_test test, Elem lo, Elem hi)
+{
+    switch (test)
+    {
+    case TEST_EQUAL:
+        return item == lo;
+    case TEST_LESS:
+        return item < lo;
+    case TEST_BETWEEN:
+        return item >= lo && item <= hi;
+    }
+
+    return false;
+}
+
+/*
+Return the index of the first item of `tree' passing `test', or -1. Only the
+block holding a match is searched for it.
+*/
+
+static int
+tree_find_test(const Tree *tree, enum elem_test test, Elem lo, Elem hi)
+{
+    TreeIter iter;
+    const Elem *items;
+    int length,
+        start,
+        i;
+
+    start = 0;
+    TreeIterInit(&iter, tree);
+    while (TreeIterNext(&iter, &items, &length))
+    {
+        for (i = 0; i + BULK_BLOCK <= length; i += BULK_BLOCK)
+            if (bulk_count(items + i, test, lo, hi) > 0)
+                break;
+
+        for (; i < length; i++)
+            if (elem_passes(items[i], test, lo, hi))
+                return start + i;
+
+        start += length;
+    }
+
+    return -1;
+}
+
+static int
+tree_count_test(const Tree *tree, enum elem_test test, Elem lo, Elem hi)
+{
+    TreeIter iter;
+    const Elem *items;
+    int length,
+        count,
+        i;
+
+    count = 0;
+    TreeIterInit(&iter, tree);
+    while (TreeIterNext(&iter, &items, &length))
+    {
+        for (i = 0; i + BULK_BLOCK <= length; i += BULK_BLOCK)
+            count += bulk_count(items + i, test, lo, hi);
+        for (; i < length; i++)
+            count += elem_passes(items[i], test, lo, hi);
+    }
+
+    return count;
+}
+
+ElemSum
+TreeSum(const Tree *tree)
+{
+    TreeIter iter;
+    const Elem *items;
+    ElemSum sum;
+    int length,
+        i;
+
+    sum = 0;
+    TreeIterInit(&iter, tree);
+    while (TreeIterNext(&iter, &items, &length))
+    {
+        for (i = 0; i + BULK_BLOCK <= length; i += BULK_BLOCK)
+            sum += bulk_sum(items + i);
+        for (; i < length; i++)
+            sum += items[i];
+    }
+
+    return sum;
+}
+
+/*
+Store the smallest and largest item of `tree' in `min' and `max', returning
+false when there are none.
+*/
+
+bool
+TreeMinMax(const Tree *tree, Elem *min, Elem *max)
+{
+    TreeIter iter;
+    const Elem *items;
+    Elem lo,
+         hi;
+    int length,
+        i;
+
+    TreeIterInit(&iter, tree);
+    if (!TreeIterNext(&iter, &items, &length))
+        return false;
+
+    lo = hi = items[0];
+    do
+    {
+        for (i = 0; i + BULK_BLOCK <= length; i += BULK_BLOCK)
+            bulk_minmax(items + i, &lo, &hi);
+        for (; i < length; i++)
+        {
+            lo = items[i] < lo ? items[i] : lo;
+            hi = items[i] > hi ? items[i] : hi;
+        }
+    }
+    while (TreeIterNext(&iter, &items, &length));
+
+    *min = lo;
+    *max = hi;
+    return true;
+}
+
+/*
+Return the index of the first item of `tree' equal to `value', or -1.
+*/
+
+int
+TreeIndexOf(const Tree *tree, Elem value)
+{
+    return tree_find_test(tree, TEST_EQUAL, value, value);
+}
+
+/*
+Return the number of items of `tree' equal to `value'.
+*/
+
+int
+TreeCountEqual(const Tree *tree, Elem value)
+{
+    return tree_count_test(tree, TEST_EQUAL, value, value);
+}
+
+/*
+Return the index of the first item of `tree' less than `value', or -1.
+*/
+
+int
+TreeFindLess(const Tree *tree, Elem value)
+{
+    return tree_find_test(tree, TEST_LESS, value, value);
+}
+
+/*
+Return the number of items of `tree' less than `value'.
+*/
+
+int
+TreeCountLess(const Tree *tree, Elem value)
+{
+    return tree_count_test(tree, TEST_LESS, value, value);
+}
+
+/*
+Return the index of the first item of `tree' from `lo' up to `hi' included,
+or -1.
+*/
+
+int
+TreeFindBetween(const Tree *tree, Elem lo, Elem hi)
+{
+    return tree_find_test(tree, TEST_BETWEEN, lo, hi);
+}
+
+/*
+Return the number of items of `tree' from `lo' up to `hi' included.
+*/
+
+int
+TreeCountBetween(const Tree *tree, Elem lo, Elem hi)
+{
+    return tree_count_test(tree, TEST_BETWEEN, lo, hi);
+}
+
+#undef BULK_BLOCK
+
+/*
+Return the index of the first item of `tree' for which `pred' holds, or -1.
+`ctx' is passed on to every call of `pred'.
+*/
+
+int
+TreeFind(const Tree *tree, bool (*pred)(Elem, void *), void *ctx)
+{
+    TreeIter iter;
+    const Elem *items;
+    int length,
+        start,
+        i;
+
+    start = 0;
+    TreeIterInit(&iter, tree);
+    while (TreeIterNext(&iter, &items, &length))
+    {
+        for (i = 0; i < length; i++)
+            if (pred(items[i], ctx))
+                return start + i;
+
+        start += length;
+    }
+
+    return -1;
+}
+
+/*
+Return the number of items of `tree' for which `pred' holds.
+*/
+
+int
+TreeCount(const Tree *tree, bool (*pred)(Elem, void *), void *ctx)
+{
+    TreeIter iter;
+    const Elem *items;
+    int length,
+        count,
+        i;
+
+    count = 0;
+    TreeIterInit(&iter, tree);
+    while (TreeIterNext(&iter, &items, &length))
+        for (i = 0; i < length; i++)
+            count += pred(items[i], ctx);
+
+    return count;
+}
+
+/*
+Set the items of `tree' from `from' up to `to' to `value'. Like TreeSet, only
+the nodes not owned by the tree are copied, and only along the paths to the
+leafs in the range.
+*/
+
+void
+TreeFillRange(Tree *tree, int from, int to, Elem value)
+{
+    int head_len,
+        offset;
+
+    assert(from >= 0 && from <= to && to <= tree->length);
+    assert(tree->map == NULL);
+    if (from == to)
+        return;
+
+    offset = tail_offset(tree);
+    head_len = head_length(tree);
+    focus_reset(tree);
+    if (from < head_len)
+        tree->head = LeafFill(tree->head, tree->edit,
+                              LEAF_FACTOR - head_len + from,
+                              LEAF_FACTOR - head_len +
+                              (to < head_len ? to : head_len),
+                              value);
+    if (tree->root && from < offset && to > head_len)
+        tree->root = NodeFill(tree->root, tree->edit, tree->height,
+                              (from > head_len ? from : head_len) - head_len,
+                              (to < offset ? to : offset) - head_len, value);
+    if (to > offset)
+        tree->tail = LeafFill(tree->tail, tree->edit,
+                              (from > offset ? from : offset) - offset,
+                              to - offset, value);
+}
+
+/* POOL */
+
+/*
+The tasks of a batch are numbered, and every thread owns a deque holding a
+range of them, from `head' up to `tail'. The owner takes tasks from the head,
+keeping to neighbouring tasks, and others steal from the tail, away from
+where the owner works. It is the Chase-Lev deque with its ends swapped, and
+without a buffer since a task is its own number. The owner only races with
+the thieves over the last task, and settles it like they do among
+themselves, by a compare and swap on the tail. No task is added while a
+batch runs, so a thread that finds every deque empty is done with it.
+*/
+
+typedef struct task_queue task_queue;
+typedef struct pool_worker pool_worker;
+
+/* Each queue fills a cache line, the owners of two never share one */
+struct task_queue
+{
+    int head;
+    int tail;
+    char pad[CACHE_LINE - 2 * sizeof(int)];
+};
+
+struct pool_worker
+{
+    TaskPool *pool;
+    int index;
+};
+
+struct TaskPool
+{
+    int threads;
+    pthread_t *ids;
+    pool_worker *workers;
+    task_queue *queues;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t finish;
+    void (*run)(void *arg, int task);
+    void *arg;
+    Allocator *allocator;
+    int batch;
+    int busy;
+    bool quit;
+};
+
+/*
+Take the task at the head of the queue of the calling thread, or return -1.
+The head is moved first and the tail read after a full fence, so that a
+thief either sees the head moved or is seen by the owner.
+*/
+
+int
+task_queue_pop(task_queue *queue)
+{
+    int head,
+        tail,
+        task;
+
+    head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+
+    if (head + 1 < tail)
+        return head;
+
+    /* The last task goes to whoever moves the tail over it first */
+    task = -1;
+    if (head + 1 == tail
+            && __atomic_compare_exchange_n(&queue->tail, &tail, head, false,
+                                           __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        task = head;
+
+    /* Either way the queue is empty now, with the head back on the tail */
+    __atomic_store_n(&queue->head, head, __ATOMIC_RELAXED);
+    return task;
+}
+
+/*
+Steal the task at the tail of the queue of another thread, or return -1 once
+it is empty. Losing the compare and swap means another thread took the task,
+not that the queue is empty, so the steal is tried again.
+*/
+
+int
+task_queue_steal(task_queue *queue)
+{
+    int head,
+        tail;
+
+    for (;;)
+    {
+        tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+        if (head >= tail)
+            return -1;
+
+        if (__atomic_compare_exchange_n(&queue->tail, &tail, tail - 1, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            return tail - 1;
+    }
+}
+
+void
+pool_work(TaskPool *pool, int index)
+{
+    int task,
+        i;
+
+    for (;;)
+    {
+        task = task_queue_pop(&pool->queues[index]);
+        for (i = 1; task < 0 && i < pool->threads; i++)
+            task = task_queue_steal(&pool->queues[(index + i) % pool->threads]);
+        if (task < 0)
+            return;
+
+        pool->run(pool->arg, task);
+    }
+}
+
+void *
+pool_thread(void *arg)
+{
+    pool_worker *worker;
+    TaskPool *pool;
+    int batch;
+
+    worker = arg;
+    pool = worker->pool;
+    batch = 0;
+    for (;;)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->batch == batch && !pool->quit)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->quit)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        batch = pool->batch;
+        pthread_mutex_unlock(&pool->lock);
+
+        /* Allocate the nodes of the batch like the thread that started it */
+        AllocatorUse(pool->allocator);
+        pool_work(pool, worker->index);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0)
+            pthread_cond_signal(&pool->finish);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/*
+Start a pool of `threads' threads, counting the thread calling TaskPoolRun.
+*/
+
+TaskPool *
+TaskPoolNew(int threads)
+{
+    TaskPool *pool;
+    int i;
+
+    assert(threads >= 1);
+    pool = calloc(1, sizeof(TaskPool));
+    pool->threads = threads;
+    pool->ids = malloc(sizeof(pthread_t) * threads);
+    pool->workers = malloc(sizeof(pool_worker) * threads);
+    pool->queues = malloc(sizeof(task_queue) * threads);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->finish, NULL);
+
+    for (i = 0; i < threads; i++)
+    {
+        pool->queues[i].head = pool->queues[i].tail = 0;
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        if (i)
+            pthread_create(&pool->ids[i], NULL, pool_thread, &pool->workers[i]);
+    }
+
+    return pool;
+}
+
+void
+TaskPoolFree(TaskPool *pool)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 1; i < pool->threads; i++)
+        pthread_join(pool->ids[i], NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->finish);
+    free(pool->ids);
+    free(pool->workers);
+    free(pool->queues);
+    free(pool);
+}
+
+/*
+Run `run(arg, task)' for every task from 0 up to `tasks', and return once all
+of them are done. The pool threads allocate nodes from the allocator in use
+by the calling thread, which hence has to be safe to share between threads,
+i.e. not an arena.
+*/
+
+void
+TaskPoolRun(TaskPool *pool, int tasks, void (*run)(void *arg, int task),
+            void *arg)
+{
+    int i;
+
+    for (i = 0; i < pool->threads; i++)
+    {
+        pool->queues[i].head = (long long)tasks * i / pool->threads;
+        pool->queues[i].tail = (long long)tasks * (i + 1) / pool->threads;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->run = run;
+    pool->arg = arg;
+    pool->allocator = node_allocator;
+    pool->busy = pool->threads - 1;
+    pool->batch++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    pool_work(pool, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy)
+        pthread_cond_wait(&pool->finish, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+The subtrees a parallel operation splits a tree into. The trie is descended
+until a node holds at most PARALLEL_GRAIN items or is a leaf, and the tail
+makes up one more chunk. The head is left to the callers. As the split only
+depends on the nodes themselves, walking the trie again in the same order
+meets the chunks in the same order. The trie of a mapped tree is descended
+through branch_child like TreeGet does.
+*/
+
+typedef struct tree_chunk tree_chunk;
+
+struct tree_chunk
+{
+    void *node;
+    int height;
+    int length;
+};
+
+bool
+chunk_whole(void *node, int height)
+{
+    return height == 0 || BranchSize(node) <= PARALLEL_GRAIN;
+}
+
+void
+chunks_push(tree_chunk **chunks, int *num_chunks, int *cap,
+            void *node, int height, int length)
+{
+    if (*num_chunks == *cap)
+    {
+        *cap *= 2;
+        *chunks = realloc(*chunks, sizeof(tree_chunk) * *cap);
+    }
+
+    (*chunks)[*num_chunks].node = node;
+    (*chunks)[*num_chunks].height = height;
+    (*chunks)[*num_chunks].length = length;
+    (*num_chunks)++;
+}
+
+void
+chunks_split(const char *map, void *node, int height,
+             tree_chunk **chunks, int *num_chunks, int *cap)
+{
+    Branch *branch;
+    int i;
+
+    if (chunk_whole(node, height))
+    {
+        chunks_push(chunks, num_chunks, cap, node, height,
+                    NodeSize(node, height));
+        return;
+    }
+
+    branch = node;
+    for (i = 0; i < branch->length; i++)
+        chunks_split(map, branch_child(map, branch, i), height - 1,
+                     chunks, num_chunks, cap);
+}
+
+/*
+Split `tree' into chunks, returning their number. The caller frees `*chunks'.
+*/
+
+int
+tree_chunks(const Tree *tree, tree_chunk **chunks)
+{
+    int num_chunks,
+        cap;
+
+    num_chunks = 0;
+    cap = 16;
+    *chunks = malloc(sizeof(tree_chunk) * cap);
+    if (tree->root)
+        chunks_split(tree->map, tree->root, tree->height,
+                     chunks, &num_chunks, &cap);
+    if (tree->tail)
+        chunks_push(chunks, &num_chunks, &cap, tree->tail, 0,
+                    tree->tail->length);
+
+    return num_chunks;
+}
+
+typedef struct reduce_job reduce_job;
+
+struct reduce_job
+{
+    const char *map;
+    tree_chunk *chunks;
+    char *parts;
+    const void *init;
+    size_t acc_size;
+    void (*reduce)(void *acc, const Elem *items, int length, void *ctx);
+    void *ctx;
+};
+
+void
+reduce_task(void *arg, int task)
+{
+    reduce_job *job;
+    tree_chunk *chunk;
+    Tree sub;
+    TreeIter iter;
+    const Elem *items;
+    void *acc;
+    int length;
+
+    job = arg;
+    chunk = &job->chunks[task];
+    acc = job->parts + job->acc_size * task;
+    memcpy(acc, job->init, job->acc_size);
+
+    /* Iterate over the chunk as a tree of its own, without a head or tail */
+    sub.length = chunk->length;
+    sub.height = chunk->height;
+    sub.edit = 0;
+    sub.root = chunk->node;
+    sub.head = NULL;
+    sub.tail = NULL;
+    sub.map = job->map;
+    TreeIterInit(&iter, &sub);
+    while (TreeIterNext(&iter, &items, &length))
+        job->reduce(acc, items, length, job->ctx);
+}
+
+/*
+Reduce the items of `tree' into `acc', which holds `acc_size' bytes and comes
+in holding the identity of the reduction. Every chunk is reduced on its own,
+starting from a copy of the identity, by calling `reduce' on its runs of
+items in order. The chunk results are then combined into `acc' in order with
+`combine', so the reduction does not need to be commutative.
+*/
+
+void
+TreeParallelReduce(const Tree *tree, TaskPool *pool,
+                   void *acc, size_t acc_size,
+                   void (*reduce)(void *acc, const Elem *items,
+                                  int length, void *ctx),
+                   void (*combine)(void *acc, const void *part, void *ctx),
+                   void *ctx)
+{
+    reduce_job job;
+    char *head_part;
+    int num_chunks,
+        i;
+
+    num_chunks = tree_chunks(tree, &job.chunks);
+    job.map = tree->map;
+    job.parts = malloc(acc_size * (num_chunks + 1));
+    job.init = acc;
+    job.acc_size = acc_size;
+    job.reduce = reduce;
+    job.ctx = ctx;
+
+    /* The head is too short to be worth a task, it is reduced right here */
+    head_part = job.parts + acc_size * num_chunks;
+    if (tree->head)
+    {
+        memcpy(head_part, acc, acc_size);
+        reduce(head_part, head_items(tree->head), tree->head->length, ctx);
+    }
+
+    TaskPoolRun(pool, num_chunks, reduce_task, &job);
+    if (tree->head)
+        combine(acc, head_part, ctx);
+    for (i = 0; i < num_chunks; i++)
+        combine(acc, job.parts + acc_size * i, ctx);
+
+    free(job.parts);
+    free(job.chunks);
+}
+
+/*
+Return a copy of `node' with `fn' applied to its items. The copy has the
+shape of `node', down to the size tables and dense flags, so it is built
+directly instead of by pushing.
+*/
+
+void *
+node_map(const char *map, void *node, int height, int edit,
+         Elem (*fn)(Elem value, void *ctx), void *ctx)
+{
+    Branch *branch,
+           *copy;
+    Leaf *leaf,
+         *leaf_copy;
+    int i;
+
+    if (height == 0)
+    {
+        leaf = node;
+        leaf_copy = LeafNew();
+        leaf_copy->edit = edit;
+        leaf_copy->length = leaf->length;
+        for (i = 0; i < leaf->length; i++)
+            leaf_copy->slots[i] = fn(leaf->slots[i], ctx);
+
+        return leaf_copy;
+    }
+
+    branch = node;
+    copy = BranchNew();
+    copy->edit = edit;
+    copy->length = branch->length;
+    copy->dense = branch->dense;
+    for (i = 0; i < branch->length; i++)
+    {
+        copy->size_table[i] = branch->size_table[i];
+        copy->slots[i] = node_map(map, branch_child(map, branch, i),
+                                  height - 1, edit, fn, ctx);
+    }
+
+    return copy;
+}
+
+typedef struct map_job map_job;
+
+struct map_job
+{
+    const char *map;
+    tree_chunk *chunks;
+    void **mapped;
+    int edit;
+    Elem (*fn)(Elem value, void *ctx);
+    void *ctx;
+};
+
+void
+map_task(void *arg, int task)
+{
+    map_job *job;
+
+    job = arg;
+    job->mapped[task] = node_map(job->map, job->chunks[task].node,
+                                 job->chunks[task].height,
+                                 job->edit, job->fn, job->ctx);
+}
+
+/*
+Copy the levels of the trie above the chunks, taking the mapped chunks in
+the order the split met them.
+*/
+
+void *
+map_top(void *node, int height, map_job *job, int *next)
+{
+    Branch *branch,
+           *copy;
+    int i;
+
+    if (chunk_whole(node, height))
+        return job->mapped[(*next)++];
+
+    branch = node;
+    copy = BranchNew();
+    copy->edit = job->edit;
+    copy->length = branch->length;
+    copy->dense = branch->dense;
+    for (i = 0; i < branch->length; i++)
+    {
+        copy->size_table[i] = branch->size_table[i];
+        copy->slots[i] = map_top(branch_child(job->map, branch, i),
+                                 height - 1, job, next);
+    }
+
+    return copy;
+}
+
+/*
+Return a new transient tree holding `fn' applied to every item of `tree'.
+The chunks are mapped in parallel, the few branches above them afterwards.
+*/
+
+Tree *
+TreeParallelMap(const Tree *tree, TaskPool *pool,
+                Elem (*fn)(Elem value, void *ctx), void *ctx)
+{
+    map_job job;
+    Tree *ret;
+    int num_chunks,
+        next,
+        i;
+
+    num_chunks = tree_chunks(tree, &job.chunks);
+    job.map = tree->map;
+    job.mapped = malloc(sizeof(void *) * (num_chunks ? num_chunks : 1));
+    job.edit = edit_new();
+    job.fn = fn;
+    job.ctx = ctx;
+    TaskPoolRun(pool, num_chunks, map_task, &job);
+
+    ret = node_alloc(sizeof(Tree));
+    ret->edit = job.edit;
+    ret->length = tree->length;
+    ret->height = tree->height;
+    next = 0;
+    if (tree->head)
+    {
+        ret->head = LeafNew();
+        ret->head->edit = job.edit;
+        ret->head->length = tree->head->length;
+        for (i = LEAF_FACTOR - tree->head->length; i < LEAF_FACTOR; i++)
+            ret->head->slots[i] = fn(tree->head->slots[i], ctx);
+    }
+    if (tree->root)
+        ret->root = map_top(tree->root, tree->height, &job, &next);
+    if (tree->tail)
+        ret->tail = job.mapped[next];
+
+    free(job.mapped);
+    free(job.chunks);
+    return ret;
+}
+
+/* CELL */
+
+/*
+The epoch a reader pinned, or 0 while it is not pinned, sits on a cache line
+of its own, as the readers write it on every pin.
+*/
+
+struct TreeReader
+{
+    char pad_before[CACHE_LINE];
+    unsigned long epoch;
+    char pad_after[CACHE_LINE];
+    TreeCell *cell;
+    TreeReader *next;
+};
+
+typedef struct cell_retired cell_retired;
+
+struct cell_retired
+{
+    Tree *tree;
+    unsigned long epoch;
+};
+
+/*
+Only the writer changes `tree' and `epoch', and only it touches the retired
+versions. `lock' guards the list of readers, which registering readers
+change and the writer scans.
+*/
+
+struct TreeCell
+{
+    Tree *tree;
+    unsigned long epoch;
+    pthread_mutex_t lock;
+    TreeReader *readers;
+    cell_retired *retired;
+    int num_retired;
+    int max_retired;
+};
+
+/*
+Take over the persistent `tree' as the first version of a new cell.
+*/
+
+TreeCell *
+TreeCellNew(Tree *tree)
+{
+    TreeCell *cell;
+
+    assert(tree->edit == 0);
+    cell = calloc(1, sizeof(TreeCell));
+    cell->tree = tree;
+    cell->epoch = 1;
+    pthread_mutex_init(&cell->lock, NULL);
+
+    return cell;
+}
+
+/*
+Release the cell along with every version it holds, once no reader is left.
+*/
+
+void
+TreeCellFree(TreeCell *cell)
+{
+    int i;
+
+    assert(cell->readers == NULL);
+    for (i = 0; i < cell->num_retired; i++)
+        TreeRelease(cell->retired[i].tree);
+    TreeRelease(cell->tree);
+    free(cell->retired);
+    pthread_mutex_destroy(&cell->lock);
+    free(cell);
+}
+
+/*
+The current version, for the writer to derive the next one from. Readers pin
+it instead.
+*/
+
+Tree *
+TreeCellGet(TreeCell *cell)
+{
+    return cell->tree;
+}
+
+/*
+Advance the epoch if every pinned reader has pinned the current one, and
+release the versions retired at least two epochs back. A reader pinned the
+epoch before the current one may still read a version retired then, but the
+epoch can not advance past it until the reader unpins.
+*/
+
+void
+cell_collect(TreeCell *cell)
+{
+    TreeReader *reader;
+    unsigned long epoch,
+                  pinned;
+    bool advance;
+    int i,
+        kept;
+
+    epoch = cell->epoch;
+    advance = true;
+    pthread_mutex_lock(&cell->lock);
+    for (reader = cell->readers; reader; reader = reader->next)
+    {
+        pinned = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST);
+        if (pinned && pinned != epoch)
+        {
+            advance = false;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cell->lock);
+
+    if (advance)
+        __atomic_store_n(&cell->epoch, ++epoch, __ATOMIC_RELEASE);
+
+    kept = 0;
+    for (i = 0; i < cell->num_retired; i++)
+        if (cell->retired[i].epoch + 2 <= epoch)
+            TreeRelease(cell->retired[i].tree);
+        else
+            cell->retired[kept++] = cell->retired[i];
+    cell->num_retired = kept;
+}
+
+/*
+Make the persistent `tree' the current version, taking it over. The version
+it replaces is released once no reader can hold it anymore.
+*/
+
+void
+TreeCellPublish(TreeCell *cell, Tree *tree)
+{
+    Tree *old;
+
+    assert(tree->edit == 0);
+    old = __atomic_exchange_n(&cell->tree, tree, __ATOMIC_SEQ_CST);
+    if (cell->num_retired == cell->max_retired)
+    {
+        cell->max_retired = cell->max_retired ? 2 * cell->max_retired : 8;
+        cell->retired = realloc(cell->retired,
+                                sizeof(cell_retired) * cell->max_retired);
+    }
+    cell->retired[cell->num_retired].tree = old;
+    cell->retired[cell->num_retired].epoch = cell->epoch;
+    cell->num_retired++;
+
+    cell_collect(cell);
+}
+
+TreeReader *
+TreeReaderNew(TreeCell *cell)
+{
+    TreeReader *reader;
+
+    reader = calloc(1, sizeof(TreeReader));
+    reader->cell = cell;
+    pthread_mutex_lock(&cell->lock);
+    reader->next = cell->readers;
+    cell->readers = reader;
+    pthread_mutex_unlock(&cell->lock);
+
+    return reader;
+}
+
+void
+TreeReaderFree(TreeReader *reader)
+{
+    TreeReader **link;
+
+    assert(reader->epoch == 0);
+    pthread_mutex_lock(&reader->cell->lock);
+    for (link = &reader->cell->readers; *link != reader; link = &(*link)->next)
+        ;
+    *link = reader->next;
+    pthread_mutex_unlock(&reader->cell->lock);
+    free(reader);
+}
+
+/*
+Return the current version, which stays valid until TreeReaderUnpin. It must
+only be read from. The epoch is pinned before the version is loaded, while
+the writer swaps the version before it scans the pinned epochs, so either
+the writer sees the pin or the reader sees the new version. Pinning by an
+exchange also lets the writer's scan synchronize with the last unpin.
+*/
+
+Tree *
+TreeReaderPin(TreeReader *reader)
+{
+    TreeCell *cell;
+
+    cell = reader->cell;
+    __atomic_exchange_n(&reader->epoch,
+                        __atomic_load_n(&cell->epoch, __ATOMIC_ACQUIRE),
+                        __ATOMIC_SEQ_CST);
+
+    return __atomic_load_n(&cell->tree, __ATOMIC_SEQ_CST);
+}
+
+void
+TreeReaderUnpin(TreeReader *reader)
+{
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* FILE */
+
+/*
+A store file starts with a header, followed by the nodes and root records of
+the versions written to it, each at an offset aligned to STORE_ALIGN. The
+nodes are written as they are in memory, except that the slots of a branch
+hold the offsets of its children. As the header is at offset 0, an offset of
+0 stands for NULL. The header records the options shaping the nodes, so that
+a build with other options refuses the file.
+*/
+
+#define STORE_MAGIC "RRBTREE2"
+#define STORE_ALIGN 16
+
+typedef struct store_header store_header;
+typedef struct store_root store_root;
+typedef struct store_entry store_entry;
+
+struct store_header
+{
+    char magic[8];
+    int branch_bits;
+    int leaf_bits;
+    int branch_size;
+    int leaf_size;
+    long long root;
+};
+
+struct store_root
+{
+    long long root;
+    long long head;
+    long long tail;
+    int length;
+    int height;
+};
+
+/*
+A store finds the nodes already in the file by their contents. Every node it
+writes, or finds in the latest version when opening the file, is entered in
+an index from a digest of its bytes in the file to its offset, and a node is
+only appended when no node with the same digest has the same bytes. A later
+session thus only appends the nodes a version changed, like the first one.
+
+Digesting every node of every version would be slow, so the store also keeps
+the nodes the last write met in a table from their address to their offset,
+which ends the walk of the next version at the nodes it shares with the last
+one. These are retained, so that their address can not be reused by another
+node, and released by the write after. Being shared with the store also keeps
+a transient from updating them in place.
+*/
+
+struct store_entry
+{
+    void *node;
+    long long offset;
+    int height;
+};
+
+typedef struct store_table store_table;
+typedef struct store_known store_known;
+
+struct store_table
+{
+    store_entry *entries;
+    int capacity;
+    int count;
+};
+
+struct store_known
+{
+    unsigned long long digest;
+    long long offset;
+};
+
+struct TreeStore
+{
+    FILE *file;
+    long long end;
+    bool failed;
+    store_table last;
+    store_table next;
+    store_known *known;
+    int known_capacity;
+    int known_count;
+};
+
+void
+store_header_init(store_header *header)
+{
+    memset(header, 0, sizeof(store_header));
+    memcpy(header->magic, STORE_MAGIC, sizeof(header->magic));
+    header->branch_bits = BRANCH_BITS;
+    header->leaf_bits = LEAF_BITS;
+    header->branch_size = sizeof(Branch);
+    header->leaf_size = sizeof(Leaf);
+}
+
+bool
+store_header_valid(const store_header *header)
+{
+    store_header expected;
+
+    store_header_init(&expected);
+    return memcmp(header, &expected, offsetof(store_header, root)) == 0;
+}
+
+/*
+Check the node at `offset' in the `map_size' bytes of `map' and the nodes
+under it, so that lookups following the offsets in the file stay inside the
+mapping and find every index they are given where the size tables say it is.
+Returns the number of items under the node, or -1 when an offset, a length
+or a size table is out of bounds.
+*/
+
+long long
+mapped_valid(const char *map, size_t map_size, long long offset, int height)
+{
+    const Branch *branch;
+    const Leaf *leaf;
+    long long size,
+              child,
+              capacity;
+    int shift,
+        i;
+
+    if (offset < (long long)sizeof(store_header) || offset % STORE_ALIGN
+            || (size_t)offset > map_size
+            || map_size - (size_t)offset < (height ? sizeof(Branch) :
+                                                     sizeof(Leaf)))
+        return -1;
+
+    if (height == 0)
+    {
+        leaf = (const Leaf *)(map + offset);
+        if (leaf->length < 0 || leaf->length > LEAF_FACTOR)
+            return -1;
+        return leaf->length;
+    }
+
+    /* Loading a bool that holds anything but 0 or 1 is undefined */
+    branch = (const Branch *)(map + offset);
+    if (branch->length < 1 || branch->length > BRANCH_FACTOR
+            || *(const unsigned char *)&branch->dense > 1)
+        return -1;
+
+    /* A child never holds more than the items a full one would */
+    shift = level_shift(height);
+    capacity = shift < 32 ? 1LL << shift : 1LL << 32;
+    size = 0;
+    for (i = 0; i < branch->length; i++)
+    {
+        child = mapped_valid(map, map_size,
+                             (long long)(size_t)branch->slots[i], height - 1);
+        if (child < 0 || child > capacity)
+            return -1;
+
+        size += child;
+        if (size > INT_MAX || branch->size_table[i] != size)
+            return -1;
+        if (branch->dense && i < branch->length - 1 && child != capacity)
+            return -1;
+    }
+
+    return size;
+}
+
+/*
+Check the root record at `offset', and the nodes of its version when `nodes'
+is set, returns whether a tree mapped from them is safe to read. Without the
+nodes, only the record itself is known to be within the file.
+*/
+
+bool
+mapped_root_valid(const char *map, size_t map_size, long long offset,
+                  bool nodes)
+{
+    const store_root *root;
+    long long size,
+              part;
+
+    if (offset < (long long)sizeof(store_header) || offset % STORE_ALIGN
+            || (size_t)offset > map_size
+            || map_size - (size_t)offset < sizeof(store_root))
+        return false;
+
+    root = (const store_root *)(map + offset);
+    if (root->height < 0 || root->height > TREE_MAX_HEIGHT
+            || root->length < 0)
+        return false;
+    if (!nodes)
+        return true;
+
+    size = 0;
+    if (root->root)
+    {
+        part = mapped_valid(map, map_size, root->root, root->height);
+        if (part < 0)
+            return false;
+        size += part;
+    }
+    if (root->head)
+    {
+        part = mapped_valid(map, map_size, root->head, 0);
+        if (part < 0)
+            return false;
+        size += part;
+    }
+    if (root->tail)
+    {
+        part = mapped_valid(map, map_size, root->tail, 0);
+        if (part < 0)
+            return false;
+        size += part;
+    }
+
+    return size == root->length;
+}
+
+size_t
+store_hash(const void *node, int capacity)
+{
+    return ((size_t)node / sizeof(void *)) * 2654435761u & (capacity - 1);
+}
+
+void
+store_table_init(store_table *table)
+{
+    table->capacity = 64;
+    table->count = 0;
+    table->entries = calloc(table->capacity, sizeof(store_entry));
+}
+
+void
+store_table_free(store_table *table)
+{
+    int i;
+
+    for (i = 0; i < table->capacity; i++)
+        if (table->entries[i].node)
+            NodeRelease(table->entries[i].node, table->entries[i].height);
+    free(table->entries);
 }
 
-bool
-BranchPush(Branch *branch, int height, int value)
-{
-    int last_slot;
+/*
+The offset `node' was written at, or 0 if it is not in `table'.
+*/
 
-    last_slot = branch->length - 1;
-    if
-    (
-        branch->length != 0 &&
-        NodePush(branch->slots[last_slot], height - 1, value)
-    )   /* Could push in last slot */
-        branch->size_table[last_slot]++;
-    else if (branch->length != BRANCH_FACTOR)
-    {   /* Can allocate new slot and push there */
-        branch->slots[branch->length] = NodeNew(height - 1);
-        NodePush(branch->slots[branch->length], height - 1, value);
+long long
+store_find(store_table *table, void *node)
+{
+    size_t i;
 
-        branch->size_table[branch->length] = branch->size_table[last_slot] + 1;
-        branch->length++;
+    i = store_hash(node, table->capacity);
+    while (table->entries[i].node)
+    {
+        if (table->entries[i].node == node)
+            return table->entries[i].offset;
+        i = (i + 1) & (table->capacity - 1);
     }
-    else /* Value cannot be pushed in the children of this branch */
-        return false;
 
-    return true;
+    return 0;
 }
 
-int
-BranchGet(Branch *branch, int height, int index)
+void
+store_insert(store_table *table, void *node, int height, long long offset)
 {
-    int shifted_index;
+    store_entry *old;
+    int old_capacity,
+        i;
+    size_t j;
+
+    if (2 * (table->count + 1) > table->capacity)
+    {   /* Keep the table at most half full */
+        old = table->entries;
+        old_capacity = table->capacity;
+        table->capacity *= 2;
+        table->entries = calloc(table->capacity, sizeof(store_entry));
+        for (i = 0; i < old_capacity; i++)
+            if (old[i].node)
+            {
+                j = store_hash(old[i].node, table->capacity);
+                while (table->entries[j].node)
+                    j = (j + 1) & (table->capacity - 1);
+                table->entries[j] = old[i];
+            }
+        free(old);
+    }
+
+    j = store_hash(node, table->capacity);
+    while (table->entries[j].node)
+        j = (j + 1) & (table->capacity - 1);
+    table->entries[j].node = NodeRetain(node);
+    table->entries[j].offset = offset;
+    table->entries[j].height = height;
+    table->count++;
+}
 
-    shifted_index = shift_index(index, height);
-    /* Check the index and adjust if neccesary */
-    while (index > branch->size_table[shifted_index])
-        shifted_index++;
+/*
+A node as it is written to the file. Reference counts and edit tokens mean
+nothing there, and neither do the slots past the length of a branch, they
+are cleared so that nodes with the same contents have the same bytes.
+*/
 
-    if (shifted_index == 0)
-        return NodeGet(branch->slots[0], height - 1, index);
-    else
-        return NodeGet(branch->slots[shifted_index],
-                       height - 1,
-                       index - branch->size_table[shifted_index - 1]);
+typedef union store_node_bytes store_node_bytes;
+
+union store_node_bytes
+{
+    Branch branch;
+    Leaf leaf;
+};
+
+size_t
+store_node_size(int height)
+{
+    return height ? sizeof(Branch) : sizeof(Leaf);
 }
 
 void
-BranchSet(Branch *branch, int height, int index, int value)
+store_normalize(store_node_bytes *node, int height)
 {
-    int shifted_index;
+    int length;
 
-    shifted_index = shift_index(index, height);
-    /* Check the index and adjust if neccesary */
-    while (index > branch->size_table[shifted_index])
-        shifted_index++;
+    node->leaf.refs = 0;
+    node->leaf.edit = 0;
+    if (height == 0)
+        return;
 
-    if (shifted_index == 0)
-        NodeSet(branch->slots[0], height - 1, index, value);
-    else
-        NodeSet(branch->slots[shifted_index],
-                height - 1,
-                index - branch->size_table[shifted_index - 1],
-                value);
+    length = node->branch.length;
+    memset(node->branch.size_table + length, 0,
+           sizeof(int) * (BRANCH_FACTOR - length));
+    memset(node->branch.slots + length, 0,
+           sizeof(void *) * (BRANCH_FACTOR - length));
 }
 
-bool
-BranchPushNode(Branch *parent, void *child, int child_len)
+/* FNV-1a */
+unsigned long long
+store_digest(const void *data, size_t size)
 {
-    if (parent->length == BRANCH_FACTOR)
-        return false;
+    const unsigned char *bytes;
+    unsigned long long digest;
+    size_t i;
 
-    parent->slots[parent->length] = child;
-    if (parent->length == 0)
-        parent->size_table[0] = child_len;
-    else
-        parent->size_table[parent->length] =
-                parent->size_table[parent->length - 1] + child_len;
-    parent->length++;
+    bytes = data;
+    digest = 14695981039346656037ull;
+    for (i = 0; i < size; i++)
+    {
+        digest ^= bytes[i];
+        digest *= 1099511628211ull;
+    }
 
-    return true;
+    return digest;
 }
 
-branch_pair
-BranchLowConcat(Branch *left, Branch *right)
+void
+store_remember(TreeStore *store, unsigned long long digest, long long offset)
 {
-    int num_nodes,
-        num_slots,
-        to_remove,
-        left_len,
-        right_len,
+    store_known *old;
+    int old_capacity,
         i;
-    Leaf **leafs,
-         **curr_leaf,
-         **merged_leafs;
-    branch_pair ret;
+    size_t j;
+
+    if (2 * (store->known_count + 1) > store->known_capacity)
+    {   /* Keep the index at most half full */
+        old = store->known;
+        old_capacity = store->known_capacity;
+        store->known_capacity *= 2;
+        store->known = calloc(store->known_capacity, sizeof(store_known));
+        for (i = 0; i < old_capacity; i++)
+            if (old[i].offset)
+            {
+                j = old[i].digest & (store->known_capacity - 1);
+                while (store->known[j].offset)
+                    j = (j + 1) & (store->known_capacity - 1);
+                store->known[j] = old[i];
+            }
+        free(old);
+    }
 
-    /* marshall nodes to array */
-    num_nodes = left->length + right->length;
-    leafs = malloc(sizeof(Leaf *) * num_nodes);
-    curr_leaf = leafs;
+    j = digest & (store->known_capacity - 1);
+    while (store->known[j].offset)
+        j = (j + 1) & (store->known_capacity - 1);
+    store->known[j].digest = digest;
+    store->known[j].offset = offset;
+    store->known_count++;
+}
 
-    for (i = 0; i < left->length; i++)
-        *curr_leaf++ = left->slots[i];
-    for (i = 0; i < right->length; i++)
-        *curr_leaf++ = right->slots[i];
+/*
+Drop the nodes at or past `end' from the index, they are written over by the
+next write after a failed one.
+*/
 
-    num_slots = 0;
-    for (i = 0; i < num_nodes; i++)
-        num_slots += leafs[i]->length;
+void
+store_forget(TreeStore *store, long long end)
+{
+    store_known *old;
+    int i;
+    size_t j;
 
-    to_remove = compactness(num_nodes, num_slots) - AVG_COMPACT;
-    if (to_remove == 0)
-    {   /* the branches do not require compacting */
-        ret.left = left;
-        ret.right = right;
-        free(leafs);
-        return ret;
-    }
-    merged_leafs = merge_leafs(leafs, num_nodes, to_remove);
+    old = store->known;
+    store->known = calloc(store->known_capacity, sizeof(store_known));
+    store->known_count = 0;
+    for (i = 0; i < store->known_capacity; i++)
+        if (old[i].offset && old[i].offset < end)
+        {
+            j = old[i].digest & (store->known_capacity - 1);
+            while (store->known[j].offset)
+                j = (j + 1) & (store->known_capacity - 1);
+            store->known[j] = old[i];
+            store->known_count++;
+        }
+    free(old);
+}
 
-    /* unmarshall leafs to branch pair */
-    num_nodes -= to_remove;
-    right_len = num_nodes > BRANCH_FACTOR ? num_nodes - BRANCH_FACTOR : 0;
-    left_len = num_nodes - right_len;
-    if (left_len)
+/*
+The offset of a node in the file with the `size' bytes of `node', whose
+digest is `digest', or 0 if there is none. The digest only picks the
+candidates, each is read back from the file to compare its bytes.
+*/
+
+long long
+store_lookup(TreeStore *store, unsigned long long digest,
+             const store_node_bytes *node, size_t size)
+{
+    store_node_bytes found;
+    size_t i;
+
+    i = digest & (store->known_capacity - 1);
+    for (; store->known[i].offset; i = (i + 1) & (store->known_capacity - 1))
     {
-        ret.left = BranchNew();
-        for (i = 0; i < left_len; i++)
-            BranchPushNode(ret.left, merged_leafs[i], merged_leafs[i]->length);
+        if (store->known[i].digest != digest)
+            continue;
 
-        if (right_len)
+        if (fflush(store->file) != 0)
         {
-            ret.right = BranchNew();
-            for (i = 0; i < right_len; i++)
-                BranchPushNode(ret.right,
-                               merged_leafs[left_len + i],
-                               merged_leafs[left_len + i]->length);
+            store->failed = true;
+            return 0;
         }
-        else
-            ret.right = NULL;
+        if (pread(fileno(store->file), &found, size,
+                  store->known[i].offset) == (ssize_t)size
+                && memcmp(&found, node, size) == 0)
+            return store->known[i].offset;
     }
-    else
-        ret.left = ret.right = NULL;
 
-    free(leafs);
-    return ret;
+    return 0;
 }
 
-branch_pair
-BranchHighConcat(Branch *left, Branch *right)
+/*
+Enter the node at `offset' in the file mapped at `map' in the index, with
+the nodes under it. A node already indexed has its children indexed too, as
+the offsets of the children are part of its bytes.
+*/
+
+void
+store_load(TreeStore *store, const char *map, long long offset, int height)
 {
-    int num_nodes,
-        num_slots,
-        to_remove,
-        left_len,
-        right_len,
-        i;
-    Branch **branches,
-           **curr_branch,
-           **merged_branches;
-    branch_pair ret;
+    store_node_bytes node;
+    unsigned long long digest;
+    size_t size,
+           i;
+    int slot;
+
+    size = store_node_size(height);
+    memcpy(&node, map + offset, size);
+    store_normalize(&node, height);
+    digest = store_digest(&node, size);
+
+    i = digest & (store->known_capacity - 1);
+    for (; store->known[i].offset; i = (i + 1) & (store->known_capacity - 1))
+        if (store->known[i].digest == digest)
+            return;
+
+    store_remember(store, digest, offset);
+    if (height)
+        for (slot = 0; slot < node.branch.length; slot++)
+            store_load(store, map, (long long)(size_t)node.branch.slots[slot],
+                       height - 1);
+}
 
-    num_nodes = left->length + right->length;
-    branches = malloc(sizeof(Branch *) * num_nodes);
-    curr_branch = branches;
+/*
+Index the nodes of the latest version in the file opened by `store', whose
+header points at its root record at `offset'. Returns false when the file
+can not be mapped or the version fails the checks of TreeOpenMappedChecked.
+*/
 
-    for (i = 0; i < left->length; i++)
-        *curr_branch++ = left->slots[i];
-    for (i = 0; i < right->length; i++)
-        *curr_branch++ = right->slots[i];
+bool
+store_load_root(TreeStore *store, long long offset)
+{
+    const store_root *root;
+    char *map;
+    bool valid;
 
-    num_slots = 0;
-    for (i = 0; i < num_nodes; i++)
-        num_slots += branches[i]->length;
+    map = mmap(NULL, store->end, PROT_READ, MAP_SHARED,
+               fileno(store->file), 0);
+    if (map == MAP_FAILED)
+        return false;
 
-    to_remove = compactness(num_nodes, num_slots) - AVG_COMPACT;
-    if (to_remove == 0)
+    valid = mapped_root_valid(map, store->end, offset, true);
+    if (valid)
     {
-        ret.left = left;
-        ret.right = right;
-        free(branches);
-        return ret;
+        root = (const store_root *)(map + offset);
+        if (root->root)
+            store_load(store, map, root->root, root->height);
+        if (root->head)
+            store_load(store, map, root->head, 0);
+        if (root->tail)
+            store_load(store, map, root->tail, 0);
     }
-    merged_branches = merge_branches(branches, num_nodes, to_remove);
+    munmap(map, store->end);
 
-    num_nodes -= to_remove;
-    right_len = num_nodes > BRANCH_FACTOR ? num_nodes - BRANCH_FACTOR : 0;
-    left_len = num_nodes - right_len;
-    if (left_len)
+    return valid;
+}
+
+/*
+Create the file at `path', or open it to append further versions. The nodes
+of the latest version in the file are indexed, so that the versions written
+after only append the nodes they change. Returns NULL when the file can not
+be opened, was written by a build with other options, or its latest version
+is corrupt.
+*/
+
+TreeStore *
+TreeStoreOpen(const char *path)
+{
+    TreeStore *store;
+    store_header header;
+
+    store = calloc(1, sizeof(TreeStore));
+    store->file = fopen(path, "r+b");
+    if (store->file == NULL)
+        store->file = fopen(path, "w+b");
+    if (store->file == NULL)
     {
-        ret.left = BranchNew();
-        for (i = 0; i < left_len; i++)
-            BranchPushNode(ret.left,
-                           merged_branches[i],
-                           merged_branches[i]->length);
+        free(store);
+        return NULL;
+    }
 
-        if (right_len)
-        {
-            ret.right = BranchNew();
-            for (i = 0; i < right_len; i++)
-                BranchPushNode(ret.right,
-                               merged_branches[left_len + i],
-                               merged_branches[left_len + i]->length);
-        }
-        else
-            ret.right = NULL;
+    store->known_capacity = 64;
+    store->known = calloc(store->known_capacity, sizeof(store_known));
+    fseek(store->file, 0, SEEK_END);
+    store->end = ftell(store->file);
+    if (store->end == 0)
+    {
+        store_header_init(&header);
+        store->end = fwrite(&header, sizeof(header), 1, store->file) ?
+                     (long long)sizeof(header) : 0;
     }
     else
-        ret.left = ret.right = NULL;
+    {
+        rewind(store->file);
+        if (fread(&header, sizeof(header), 1, store->file) != 1
+                || !store_header_valid(&header)
+                || (header.root && !store_load_root(store, header.root)))
+            store->end = 0;
+    }
 
-    free(branches);
-    return ret;
+    if (store->end == 0)
+    {
+        fclose(store->file);
+        free(store->known);
+        free(store);
+        return NULL;
+    }
+
+    store_table_init(&store->last);
+    store_table_init(&store->next);
+
+    return store;
 }
 
-/* TREE */
+/*
+Write `size' bytes of `data' at the end of the file, after padding it to
+STORE_ALIGN, and return the offset they were written at.
+*/
 
-Tree *
-TreeNew(void)
+long long
+store_append(TreeStore *store, const void *data, size_t size)
 {
-    return calloc(1, sizeof(Tree));
+    static const char padding[STORE_ALIGN];
+    long long offset;
+    size_t pad;
+
+    pad = (size_t)-store->end & (STORE_ALIGN - 1);
+    offset = store->end + pad;
+    if (fwrite(padding, 1, pad, store->file) != pad
+            || fwrite(data, 1, size, store->file) != size)
+        store->failed = true;
+    store->end = offset + size;
+
+    return offset;
 }
 
-void
-TreeHeighten(Tree *tree)
+/*
+Write the nodes under `node' that are not in the file yet, children first so
+that their offsets are known by the time their parent is written, and return
+the offset of `node'. The walk stops at the nodes the last write met.
+*/
+
+long long
+store_node(TreeStore *store, void *node, int height)
 {
-    Branch *branch;
+    store_node_bytes copy;
+    unsigned long long digest;
+    long long offset;
+    size_t size;
+    int i;
 
-    branch = BranchNew();
-    branch->length = 1;
-    branch->size_table[0] = tree->length;
-    branch->slots[0] = tree->root;
+    offset = store_find(&store->next, node);
+    if (offset)
+        return offset;
 
-    tree->height++;
-    tree->root = branch;
+    offset = store_find(&store->last, node);
+    if (offset == 0)
+    {
+        size = store_node_size(height);
+        memcpy(&copy, node, size);
+        if (height)
+            for (i = 0; i < copy.branch.length; i++)
+                copy.branch.slots[i] = (void *)(size_t)
+                    store_node(store, ((Branch *)node)->slots[i], height - 1);
+        store_normalize(&copy, height);
+
+        digest = store_digest(&copy, size);
+        offset = store_lookup(store, digest, &copy, size);
+        if (offset == 0)
+        {
+            offset = store_append(store, &copy, size);
+            store_remember(store, digest, offset);
+        }
+    }
+    store_insert(&store->next, node, height, offset);
+
+    return offset;
 }
 
-void
-TreePush(Tree *tree, int value)
+/*
+Append the nodes of `tree' that are not in the file yet, and make it the
+version the file opens to. The header is only pointed at the new version
+once all of it is on disk, so that a failed write leaves the last version in
+place, and the next write goes over what it appended, after dropping it from
+the index. The nodes of the new version only become the shortcut of the next
+write once the header is on disk as well. When writing the header fails, it
+may or may not have reached the file, so the nodes it points at are kept
+where they are, but the next write starts over from the last version.
+Returns false on a write error.
+*/
+
+bool
+TreeStoreWrite(TreeStore *store, const Tree *tree)
 {
-    if (tree->length == 0)
-        tree->root = LeafNew();
-    if (!NodePush(tree->root, tree->height, value))
-    {   /* Could not push value in current root node, heighten tree */
-        TreeHeighten(tree);
-        NodePush(tree->root, tree->height, value);
+    store_root root;
+    long long start,
+              offset;
+
+    assert(tree->map == NULL);
+    store->failed = false;
+    start = store->end;
+    fseek(store->file, (long)store->end, SEEK_SET);
+
+    memset(&root, 0, sizeof(root));
+    root.root = tree->root ? store_node(store, tree->root, tree->height) : 0;
+    root.head = tree->head ? store_node(store, tree->head, 0) : 0;
+    root.tail = tree->tail ? store_node(store, tree->tail, 0) : 0;
+    root.length = tree->length;
+    root.height = tree->height;
+    offset = store_append(store, &root, sizeof(root));
+    if (fflush(store->file) != 0 || store->failed
+            || fsync(fileno(store->file)) != 0)
+    {
+        store_table_free(&store->next);
+        store_table_init(&store->next);
+        store_forget(store, start);
+        store->end = start;
+        return false;
     }
 
-    tree->length++;
-}
+    fseek(store->file, offsetof(store_header, root), SEEK_SET);
+    if (fwrite(&offset, sizeof(offset), 1, store->file) != 1
+            || fflush(store->file) != 0 || fsync(fileno(store->file)) != 0)
+    {
+        store_table_free(&store->next);
+        store_table_init(&store->next);
+        return false;
+    }
 
-int
-TreeGet(Tree *tree, int index)
-{
-    assert(index < tree->length);
-    return NodeGet(tree->root, tree->height, index);
+    /* The nodes of this version end the walk of the next one */
+    store_table_free(&store->last);
+    store->last = store->next;
+    store_table_init(&store->next);
+
+    return true;
 }
 
 void
-TreeSet(Tree *tree, int index, int value)
+TreeStoreClose(TreeStore *store)
 {
-    assert(index < tree->length);
-    return NodeSet(tree->root, tree->height, index, value);
+    store_table_free(&store->last);
+    store_table_free(&store->next);
+    free(store->known);
+    fclose(store->file);
+    free(store);
 }
 
+/*
+Map the latest version written to the file at `path', checking its nodes
+when `check' is set. Returns NULL when the file can not be mapped, has no
+version yet, was written by a build with other options, or holds offsets or
+lengths out of bounds among those checked.
+*/
+
 Tree *
-TreeConcat(Tree *left, Tree *right)
+mapped_open(const char *path, bool check)
 {
-    branch_pair result;
+    const store_header *header;
+    const store_root *root;
+    struct stat st;
+    Tree *tree;
+    char *map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(store_header))
+    {
+        close(fd);
+        return NULL;
+    }
 
-    assert(left->height == 1);
-    assert(right->height == 1);
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
 
-    result = BranchLowConcat(left->root, right->root);
-    if (result.left)
+    header = (const store_header *)map;
+    if (!store_header_valid(header)
+            || !mapped_root_valid(map, st.st_size, header->root, check))
     {
-        Tree *new_tree;
-        
-        new_tree = TreeNew();
-        if (result.right)
-        {   /* Both resulting branches contain nodes */
-            Branch *new_root;
-
-            new_root = BranchNew();
-            BranchPushNode(new_root, result.left, result.left->length);
-            BranchPushNode(new_root, result.right, result.right->length);
+        munmap(map, st.st_size);
+        return NULL;
+    }
 
-            new_tree->length = new_root->length;
-            new_tree->height = 2;
-            new_tree->root = new_root;
+    root = (const store_root *)(map + header->root);
+    tree = TreeNew();
+    tree->edit = 0;
+    tree->length = root->length;
+    tree->height = root->height;
+    tree->root = root->root ? map + root->root : NULL;
+    tree->head = root->head ? (Leaf *)(map + root->head) : NULL;
+    tree->tail = root->tail ? (Leaf *)(map + root->tail) : NULL;
+    tree->map = map;
+    tree->map_size = st.st_size;
+
+    return tree;
+}
 
-            return new_tree;
-        }
-        else
-        {   /* All the values are in the left result node */
-            new_tree->length = result.left->length;
-            new_tree->height = 1;
-            new_tree->root = result.left;
+/*
+Map the latest version written to the file at `path'. Only the header and
+the root record are checked, so that opening takes the same time for any
+size of tree and the nodes are only read in as lookups and iterators touch
+them. The file has to be trusted: nodes changed after it was written can
+make reads leave the mapping.
+*/
 
-            return new_tree;
-        }
-    }
-    else /* The two trees are empty, return an empty tree */
-        return left;
+Tree *
+TreeOpenMapped(const char *path)
+{
+    return mapped_open(path, false);
 }
 
-void
-TreePushArray(Tree *tree, int arr_len, int *arr)
-{
-    int i;
+/*
+Map the latest version written to the file at `path', after checking every
+node of it to be within the file and its bounds, which reads all of them in.
+Returns NULL when the file fails the checks, so it may come from anywhere.
+*/
 
-    for (i = 0; i < arr_len; i++)
-        TreePush(tree, arr[i]);
+Tree *
+TreeOpenMappedChecked(const char *path)
+{
+    return mapped_open(path, true);
 }
 
+#undef STORE_MAGIC
+#undef STORE_ALIGN
+
 /* MISC */
 
 void
@@ -761,10 +6316,30 @@ ArrPrint(int *arr, int length)
     }
 }
 
+void
+items_print(const Elem *items, int length)
+{
+    int i;
+
+    if (length == 0)
+        printf("[ ]\n");
+    else
+    {
+        printf("[ ");
+        for (i = 0; i < length - 1; i++)
+        {
+            ELEM_PRINT(items[i]);
+            printf(", ");
+        }
+        ELEM_PRINT(items[i]);
+        printf(" ]\n");
+    }
+}
+
 void
 LeafPrint(Leaf *leaf)
 {
-    ArrPrint(leaf->slots, leaf->length);
+    items_print(leaf->slots, leaf->length);
 }
 
 void
@@ -805,70 +6380,29 @@ BranchPrint(Branch *branch, int height, int indent)
 void
 TreePrint(Tree *tree)
 {
+    assert(tree->map == NULL);
     printf("[ height: %i\n", tree->height);
     printf(", length: %i\n", tree->length);
+    printf(", head -> ");
+    if (tree->head == NULL)
+        printf("[ ]\n");
+    else
+        items_print(head_items(tree->head), tree->head->length);
+
     printf(", root -> ");
 
-    if (tree->height == 0)
+    if (tree->root == NULL)
+        printf("[ ]\n");
+    else if (tree->height == 0)
         LeafPrint(tree->root);
     else
         BranchPrint(tree->root, tree->height, 10);
 
-    printf("]\n");
-}
-
-#undef BRANCH_FACTOR
-#undef SHIFT_BITS
-#undef SHIFT_MASK
-#undef AVG_COMPACT
-
-int primes[] = {  2,   3,   5,   7,  11,  13,  17,  19,  23,  29,
-                 31,  37,  41,  43,  47,  53,  59,  61,  67,  71,
-                 73,  79,  83,  89,  97, 101, 103, 107, 109, 113,
-                127, 131, 137, 139, 149, 151, 157, 163, 167, 173,
-                179, 181, 191, 193, 197, 199, 211, 223, 227, 229,
-                233, 239, 241, 251, 257, 263, 269, 271, 277, 281,
-                283, 293, 307, 311, 313, 317, 331, 337, 347, 349,
-                353, 359, 367, 373, 379, 383, 389, 397, 401, 409,
-                419, 421, 431, 433, 439, 443, 449, 457, 461, 463,
-                467, 479, 487, 491, 499, 503, 509, 521, 523, 541};
+    printf(", tail -> ");
+    if (tree->tail == NULL)
+        printf("[ ]\n");
+    else
+        LeafPrint(tree->tail);
 
-int
-main()
-{
-    Tree *tree_1, *tree_2, *tree_result;
-    Branch *branch_1, *branch_2;
-    Leaf *leaf_1, *leaf_2, *leaf_3, *leaf_4, *leaf_5, *leaf_6;
-
-    branch_1 =
-    BranchFromLeafArr((Leaf *[]){
-        LeafFromArr((int[]){1, 2, 3, 4}, 4),
-        LeafFromArr((int[]){5, 6}, 2),
-    }, 2);
-
-    branch_2 =
-    BranchFromLeafArr((Leaf *[]){ 
-        LeafFromArr((int[]){7, 8, 9}, 3),
-        LeafFromArr((int[]){10, 11}, 2),
-        LeafFromArr((int[]){12, 13}, 2),
-        LeafFromArr((int[]){14, 15, 16}, 3),
-    }, 4);
-
-    tree_1 = TreeNew();
-    tree_1->length = 6;
-    tree_1->height = 1;
-    tree_1->root = branch_1;
-    TreePrint(tree_1);
-    printf("\n\n");
-
-    tree_2 = TreeNew();
-    tree_2->length = 10;
-    tree_2->height = 1;
-    tree_2->root = branch_2;
-    TreePrint(tree_2);
-    printf("\n\n");
-
-    tree_result = TreeConcat(tree_1, tree_2);
-    TreePrint(tree_result);
+    printf("]\n");
 }
-
@@ -0,0 +1,414 @@
+#ifndef RRBT_H
+#define RRBT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+The branching factor is fixed at build time through `BRANCH_BITS', the number
+of index bits consumed by every level of the tree, e.g. `cc -DBRANCH_BITS=5'
+for a factor of 32. The node types, the radix shifts and the concatenation
+code are all derived from it, so a wider factor only changes the tree depth
+(counting the leafs, with the default leafs of ints described below). As the
+options shape the node types, the library and every program including this
+header have to be built with the same ones, see OPTS in the Makefile.
+
+        BRANCH_BITS   BRANCH_FACTOR   height of a 10M element tree
+             2              4                     11
+             4             16                      6
+             5             32                      5
+             6             64                      4
+*/
+
+#ifndef BRANCH_BITS
+#define BRANCH_BITS 2
+#endif
+
+#if BRANCH_BITS < 2 || BRANCH_BITS > 6
+#error "BRANCH_BITS must be between 2 and 6 (a factor of 4 up to 64)"
+#endif
+
+#define BRANCH_FACTOR (1 << BRANCH_BITS)
+
+/*
+The items are stored unboxed in the leafs, their type is fixed at build time
+through `ELEM_TYPE'. This is a single instantiation per build, so a program
+needing trees of several types builds the library once per type. A type other
+than the default int comes with `ELEM_PRINT', which prints an item for the
+debug output, and possibly `ELEM_SUM', the type TreeSum adds the items up in,
+which is the item type unless it is narrower than an int, e.g.
+
+        cc -DELEM_TYPE=double -D'ELEM_PRINT(value)=printf("%g", (value))'
+
+Leafs are sized apart from branches, by `LEAF_BITS'. Unless it is given, a
+leaf holds as many items as fill a cache line, and never fewer than a branch
+has slots, so that scanning a leaf never stops at a partial line:
+
+        ELEM_TYPE     BRANCH_BITS   LEAF_FACTOR   bytes of items per leaf
+        char               5             64                  64
+        int                2             16                  64
+        int                5             32                 128
+        double             5             32                 256
+*/
+
+#ifndef ELEM_TYPE
+#define ELEM_TYPE int
+#define ELEM_SUM long long
+#define ELEM_PRINT(value) printf("%i", (value))
+#endif
+
+#ifndef ELEM_PRINT
+#error "ELEM_PRINT must be given along with ELEM_TYPE"
+#endif
+
+#ifndef ELEM_SUM
+#define ELEM_SUM ELEM_TYPE
+#endif
+
+typedef ELEM_TYPE Elem;
+typedef ELEM_SUM ElemSum;
+
+/* Fails to compile when the items would be summed in a narrow type */
+typedef char elem_sum_check[sizeof(ElemSum) >= sizeof(int) ? 1 : -1];
+
+#define CACHE_LINE 64
+#define LINE_ITEMS (CACHE_LINE / sizeof(Elem))
+
+#ifndef LEAF_BITS
+#define LEAF_BITS                                                       \
+    (LINE_ITEMS <= (1 << BRANCH_BITS) ? BRANCH_BITS :                   \
+     LINE_ITEMS <= 8 ? 3 : LINE_ITEMS <= 16 ? 4 : LINE_ITEMS <= 32 ? 5 : 6)
+#endif
+
+#define LEAF_FACTOR (1 << LEAF_BITS)
+
+typedef struct Tree Tree;
+typedef struct Branch Branch;
+typedef struct Leaf Leaf;
+typedef struct Allocator Allocator;
+
+struct Allocator
+{
+    void *(*alloc)(Allocator *allocator, size_t size);
+    void  (*free)(Allocator *allocator, void *ptr, size_t size);
+};
+
+extern Allocator SlabAllocator;
+
+Allocator *AllocatorUse(Allocator *allocator);
+Allocator *ArenaNew(void);
+     void  ArenaFree(Allocator *arena);
+
+/*
+The rightmost leaf of a tree is kept out of the trie in `tail', so that
+appending only has to touch the trie once every LEAF_FACTOR pushes, when the
+full tail gets pushed into it as a whole leaf. The leftmost leaf is kept out
+of it in `head' the same way for prepending, which fills the head from its
+last slot down: its `head->length' items are the last ones of its slots. The
+first `head->length' items of the tree live in the head, the last
+`tail->length' in the tail, the rest of them in `root'. `head', `root' and
+`tail' are NULL when they don't contain any items.
+
+A tree is either transient or persistent. A transient tree carries an `edit'
+token and owns the nodes tagged with the same token, which TreeSet and
+TreePush update in place; any other node they need to change is copied first,
+and the copy is tagged so that it is owned from then on. A persistent tree has
+an `edit' of 0, which no node can be owned by, so every update copies its
+path. TreeNew returns a transient tree, TreeTransient and TreePersistent
+convert between the two.
+
+A transient tree also keeps its `focus', the path down to the leaf it last
+accessed, which lets accesses near each other skip most of the descent. It is
+allocated when the tree is made transient or writes to its trie, never by a
+read, and freed when the tree is made persistent. A
+tree opened from a file by TreeOpenMapped has its nodes in the mapping at
+`map', see below.
+*/
+
+struct Tree
+{
+    int length;
+    int height;
+    int edit;
+    void *root;
+    Leaf *head;
+    Leaf *tail;
+    struct tree_focus *focus;
+    const char *map;
+    size_t map_size;
+};
+
+Tree *TreeNew(void);
+void  TreeHeighten(Tree *tree);
+void  TreePush(Tree *tree, Elem value);
+void  TreePushArray(Tree *tree, int arr_len, const Elem *arr);
+void  TreePushLeaf(Tree *tree, Leaf *leaf);
+void  TreeFlushTail(Tree *tree);
+void  TreePrepend(Tree *tree, Elem value);
+Elem  TreePop(Tree *tree);
+Elem  TreePopFront(Tree *tree);
+Tree *TreeAssoc(const Tree *tree, int index, Elem value);
+Tree *TreeConj(const Tree *tree, Elem value);
+Tree *TreeTransient(const Tree *tree);
+Tree *TreePersistent(Tree *tree);
+Elem  TreeGet(Tree *tree, int index);
+void  TreeSet(Tree *tree, int index, Elem value);
+Tree *TreeConcat(const Tree *left, const Tree *right);
+Tree *TreeConcatMany(Tree **trees, int n);
+void  TreeRelease(Tree *tree);
+Tree *TreeTake(const Tree *tree, int n);
+Tree *TreeDrop(const Tree *tree, int n);
+Tree *TreeSlice(const Tree *tree, int from, int to);
+void  TreeSplitAt(const Tree *tree, int index, Tree **left, Tree **right);
+void  TreeInsertAt(Tree *tree, int index, Elem value);
+void  TreeInsertArrayAt(Tree *tree, int index, int arr_len, const Elem *arr);
+Elem  TreeRemoveAt(Tree *tree, int index);
+void  TreeRemoveRange(Tree *tree, int from, int to);
+bool  TreeCompact(Tree *tree, int budget);
+
+/*
+An iterator walks the items of a tree a whole leaf at a time. It keeps the
+path from the root down to the leaf it is in, so stepping to a neighbouring
+leaf only climbs as far as the nearest branch with a slot left on that side,
+instead of descending from the root for every leaf. The iterator borrows the
+tree, which must not be changed or released while it is in use.
+*/
+
+#define TREE_MAX_HEIGHT 32
+
+typedef struct TreeIter TreeIter;
+
+struct TreeIter
+{
+    const Tree *tree;
+    int index;
+    int leaf_start;
+    Leaf *leaf;
+    Branch *branches[TREE_MAX_HEIGHT];
+    int slots[TREE_MAX_HEIGHT];
+};
+
+void  TreeIterInit(TreeIter *iter, const Tree *tree);
+void  TreeIterSeek(TreeIter *iter, int index);
+bool  TreeIterNext(TreeIter *iter, const Elem **items, int *length);
+bool  TreeIterPrev(TreeIter *iter, const Elem **items, int *length);
+
+/*
+A builder assembles a tree bottom-up from a stream of items. It fills one leaf
+at a time and keeps the rightmost, still open branch of every level, pushing
+a branch into the level above as soon as it is full. Every node is written
+once and the result is dense throughout.
+*/
+
+typedef struct TreeBuilder TreeBuilder;
+
+struct TreeBuilder
+{
+    int edit;
+    int length;
+    int height;
+    Leaf *leaf;
+    Branch *levels[TREE_MAX_HEIGHT];
+};
+
+Tree *TreeFromArray(const Elem *arr, size_t arr_len);
+void  TreeBuilderInit(TreeBuilder *builder);
+void  TreeBuilderPush(TreeBuilder *builder, Elem value);
+void  TreeBuilderPushArray(TreeBuilder *builder,
+                           const Elem *arr, size_t arr_len);
+Tree *TreeBuilderFinish(TreeBuilder *builder);
+
+/*
+Bulk operations run over the tree a leaf at a time. The sum, the bounds and
+the comparisons against one or two values go over each leaf in blocks of a
+fixed size that the compiler can vectorize. TreeFind and TreeCount call their
+predicate on every item instead, which keeps them scalar: prefer the typed
+comparisons when one fits. All but the fill compare items, so they need an
+arithmetic item type.
+*/
+
+ElemSum TreeSum(const Tree *tree);
+   bool TreeMinMax(const Tree *tree, Elem *min, Elem *max);
+    int TreeIndexOf(const Tree *tree, Elem value);
+    int TreeCountEqual(const Tree *tree, Elem value);
+    int TreeFindLess(const Tree *tree, Elem value);
+    int TreeCountLess(const Tree *tree, Elem value);
+    int TreeFindBetween(const Tree *tree, Elem lo, Elem hi);
+    int TreeCountBetween(const Tree *tree, Elem lo, Elem hi);
+    int TreeFind(const Tree *tree, bool (*pred)(Elem, void *), void *ctx);
+    int TreeCount(const Tree *tree, bool (*pred)(Elem, void *), void *ctx);
+   void TreeFillRange(Tree *tree, int from, int to, Elem value);
+
+/*
+A task pool runs a batch of independent tasks over a fixed set of threads,
+the calling thread being one of them. Each thread starts on its own share of
+the batch and steals from the others once it runs out, all without locks but
+for waiting on the next batch. The parallel tree
+operations split the trie at branch boundaries into subtrees of at most
+PARALLEL_GRAIN items, one task each.
+*/
+
+#ifndef PARALLEL_GRAIN
+#define PARALLEL_GRAIN (64 * 1024)
+#endif
+
+typedef struct TaskPool TaskPool;
+
+TaskPool *TaskPoolNew(int threads);
+    void  TaskPoolFree(TaskPool *pool);
+    void  TaskPoolRun(TaskPool *pool, int tasks,
+                      void (*run)(void *arg, int task), void *arg);
+
+void  TreeParallelReduce(const Tree *tree, TaskPool *pool,
+                         void *acc, size_t acc_size,
+                         void (*reduce)(void *acc, const Elem *items,
+                                        int length, void *ctx),
+                         void (*combine)(void *acc, const void *part,
+                                         void *ctx),
+                         void *ctx);
+Tree *TreeParallelMap(const Tree *tree, TaskPool *pool,
+                      Elem (*fn)(Elem value, void *ctx), void *ctx);
+
+/*
+A cell publishes successive versions of a tree from a single writer to any
+number of reader threads. The writer derives a new persistent version from
+the current one, by path copying or through a transient, and publishes it
+with one atomic swap, so readers never see a half updated tree. A reader
+pins the current version for as long as it reads from it, which costs one
+atomic exchange per pin and nothing per lookup. A replaced version is only
+released once every reader that could still hold it has unpinned, tracked
+by epochs: the cell advances its epoch once every pinned reader has caught
+up with it, and a version retired two epochs back is out of reach of them
+all.
+*/
+
+typedef struct TreeCell TreeCell;
+typedef struct TreeReader TreeReader;
+
+  TreeCell *TreeCellNew(Tree *tree);
+      void  TreeCellFree(TreeCell *cell);
+      Tree *TreeCellGet(TreeCell *cell);
+      void  TreeCellPublish(TreeCell *cell, Tree *tree);
+TreeReader *TreeReaderNew(TreeCell *cell);
+      void  TreeReaderFree(TreeReader *reader);
+      Tree *TreeReaderPin(TreeReader *reader);
+      void  TreeReaderUnpin(TreeReader *reader);
+
+/*
+Trees can be stored in a file and mapped back in. A store appends the nodes
+of every tree written to it, with the offsets of their children in the file in
+place of pointers, followed by a record of the tree's root. It finds the nodes
+already in the file by their contents, so that a version only appends the
+nodes it does not share with the versions written in the same session, or
+with the latest version in the file when it was opened. The file header
+points at the latest version, which TreeOpenMapped maps read only: its nodes
+are used straight from the mapped pages, which are only read in as they are
+touched. It trusts the nodes of the file, TreeOpenMappedChecked checks them
+all to be within the file and their bounds first, for files that may have
+been changed or cut short.
+
+A mapped tree serves TreeGet, the iterator and the bulk operations built on
+it, and is unmapped by TreeRelease. It cannot be changed, nor share its nodes
+with other trees. A file can only be read by builds with the same options
+as the one writing it.
+*/
+
+typedef struct TreeStore TreeStore;
+
+TreeStore *TreeStoreOpen(const char *path);
+     bool  TreeStoreWrite(TreeStore *store, const Tree *tree);
+     void  TreeStoreClose(TreeStore *store);
+     Tree *TreeOpenMapped(const char *path);
+     Tree *TreeOpenMappedChecked(const char *path);
+
+/*
+`refs' has to stay the first member of both node types, so that a node can be
+retained without knowing its height.
+*/
+
+/*
+A branch is `dense' when all of its slots but the last hold as many items as
+they possibly can, as is the case for branches built by pushing. The slot of
+an index is then found by the radix shift alone, only the relaxed branches
+produced by concatenating and slicing have to search their size table. The
+flag is kept conservatively, i.e. a dense branch may still be flagged as
+relaxed, which only costs a search.
+*/
+
+struct Branch
+{
+    int refs;
+    int length;
+    int edit;
+    bool dense;
+    int size_table[BRANCH_FACTOR];
+    void *slots[BRANCH_FACTOR];
+};
+
+Branch *BranchNew(void);
+  bool  BranchPush(Branch *branch, int height, Elem value);
+  Elem  BranchGet(Branch *branch, int height, int index);
+  void  BranchSet(Branch *branch, int height, int index, Elem value);
+  bool  BranchPushNode(Branch *parent, void *child, int child_len);
+   int  BranchSize(Branch *branch);
+  void *BranchFirst(Branch *branch);
+  void *BranchLast(Branch *branch);
+Branch *BranchCopy(Branch *branch);
+Branch *BranchRetain(Branch *branch);
+  void  BranchRelease(Branch *branch, int height);
+Branch *BranchEditable(Branch *branch, int edit, int height);
+Branch *BranchAssoc(Branch *branch, int edit, int height, int index, Elem value);
+Branch *BranchFill(Branch *branch, int edit, int height,
+                   int from, int to, Elem value);
+Branch *BranchInsert(Branch *branch, int edit, int height, int index,
+                     int arr_len, const Elem *arr, Branch **split);
+Branch *BranchRemove(Branch *branch, int edit, int height, int from, int to);
+Branch *BranchConjLeaf(Branch *branch, int edit, int height, Leaf *leaf);
+Branch *BranchConsLeaf(Branch *branch, int edit, int height, Leaf *leaf);
+Branch *BranchPopLastLeaf(Branch *branch, int edit, int height, Leaf **leaf);
+Branch *BranchPopFirstLeaf(Branch *branch, int edit, int height, Leaf **leaf);
+Branch *BranchTake(Branch *branch, int height, int n);
+Branch *BranchDrop(Branch *branch, int height, int n);
+
+
+struct Leaf
+{
+    int refs;
+    int length;
+    int edit;
+    Elem slots[LEAF_FACTOR];
+};
+
+Leaf *LeafNew(void);
+bool  LeafPush(Leaf *leaf, Elem value);  
+Elem  LeafGet(Leaf *leaf, int index);
+void  LeafSet(Leaf *leaf, int index, Elem value);
+void  LeafPushArray(Leaf *leaf, int arr_len, const Elem *arr);
+Leaf *LeafCopy(Leaf *leaf);
+Leaf *LeafRetain(Leaf *leaf);
+void  LeafRelease(Leaf *leaf);
+Leaf *LeafEditable(Leaf *leaf, int edit);
+Leaf *LeafAssoc(Leaf *leaf, int edit, int index, Elem value);
+Leaf *LeafFill(Leaf *leaf, int edit, int from, int to, Elem value);
+Leaf *LeafInsert(Leaf *leaf, int edit, int index, int arr_len, const Elem *arr);
+Leaf *LeafRemove(Leaf *leaf, int edit, int from, int to);
+Leaf *LeafTake(Leaf *leaf, int n);
+Leaf *LeafDrop(Leaf *leaf, int n);
+
+void *NodeRetain(void *node);
+void  NodeRelease(void *node, int height);
+
+Leaf   *LeafFromArr(Elem *arr, int arr_len);
+Branch *BranchFromLeafArr(Leaf *arr[], int arr_len);
+Branch *BranchFromBranchArr(Branch *arr[], int arr_len);
+
+/*
+Debug output, printing the nodes of a tree along with their size tables.
+*/
+
+void  ArrPrint(int *arr, int length);
+void  LeafPrint(Leaf *leaf);
+void  BranchPrint(Branch *branch, int height, int indent);
+void  TreePrint(Tree *tree);
+
+#endif
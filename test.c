@@ -0,0 +1,1993 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "rrbt.h"
+
+/*
+Differential tests of the tree operations against a flat array holding the
+same items. Every operation is applied to both, and the tree is walked now
+and then to check its structure: size tables match the sizes of the nodes
+below them, branches flagged dense are, no node is empty, the trie has no
+single slot root left over after shrinking, and the items read back are
+those of the array. Run by `make test', for the default options and for the
+smallest factors, which make for the deepest trees.
+*/
+
+/* The compactness concatenations keep to, AVG_COMPACT in rrbt.c */
+#define MAX_COMPACT 1
+
+#define MAX_ITEMS (1 << 18)
+
+typedef struct Model Model;
+
+struct Model
+{
+    Elem *items;
+    int length;
+};
+
+unsigned int rand_state = 2463534242u;
+
+/* xorshift, so that every run makes the same calls */
+int
+rand_below(int n)
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return (int)((rand_state & 0x7fffffff) % (unsigned int)n);
+}
+
+void
+expect(bool ok, const char *what, const char *test, int step)
+{
+    if (ok)
+        return;
+
+    fprintf(stderr, "FAIL %s, step %d: %s\n", test, step, what);
+    exit(1);
+}
+
+/* MODEL */
+
+void
+model_insert(Model *model, int index, int arr_len, const Elem *arr)
+{
+    memmove(model->items + index + arr_len, model->items + index,
+            (model->length - index) * sizeof(Elem));
+    memcpy(model->items + index, arr, arr_len * sizeof(Elem));
+    model->length += arr_len;
+}
+
+void
+model_remove(Model *model, int from, int to)
+{
+    memmove(model->items + from, model->items + to,
+            (model->length - to) * sizeof(Elem));
+    model->length -= to - from;
+}
+
+Model *
+model_copy(const Model *model)
+{
+    Model *copy;
+
+    copy = malloc(sizeof(Model));
+    copy->items = malloc(MAX_ITEMS * sizeof(Elem));
+    memcpy(copy->items, model->items, model->length * sizeof(Elem));
+    copy->length = model->length;
+
+    return copy;
+}
+
+void
+model_free(Model *model)
+{
+    free(model->items);
+    free(model);
+}
+
+/* CHECKS */
+
+/* The compactness of rrbt.c, the number of nodes over the fewest needed */
+
+int
+extra_nodes(int nodes, int slots, int factor)
+{
+    return nodes - ((slots - 1) / factor) - 1;
+}
+
+/*
+Check the subtree under `node' of `height' and return the number of items it
+holds. With `compact', every branch also has to be within MAX_COMPACT.
+*/
+
+int
+check_node(void *node, int height, bool compact, const char *test, int step)
+{
+    Branch *branch;
+    long long capacity;
+    int size,
+        slots,
+        i;
+
+    if (height == 0)
+    {
+        size = ((Leaf *)node)->length;
+        expect(size >= 1 && size <= LEAF_FACTOR, "leaf length", test, step);
+        return size;
+    }
+
+    branch = node;
+    expect(branch->length >= 1 && branch->length <= BRANCH_FACTOR,
+           "branch length", test, step);
+    capacity = LEAF_FACTOR;
+    for (i = 1; i < height; i++)
+        capacity *= BRANCH_FACTOR;
+    size = slots = 0;
+    for (i = 0; i < branch->length; i++)
+    {
+        size += check_node(branch->slots[i], height - 1, compact, test, step);
+        expect(branch->size_table[i] == size, "size table", test, step);
+        if (branch->dense && i < branch->length - 1)
+            expect(size == capacity * (i + 1), "dense flag", test, step);
+        slots += height == 1 ? 1 : ((Branch *)branch->slots[i])->length;
+    }
+    if (compact)
+        expect(extra_nodes(branch->length, height == 1 ? size : slots,
+                           height == 1 ? LEAF_FACTOR : BRANCH_FACTOR)
+               <= MAX_COMPACT, "compactness", test, step);
+
+    return size;
+}
+
+/*
+Check the layout of the trie of `tree' around its head and tail.
+*/
+
+void
+check_trie(Tree *tree, bool compact, const char *test, int step)
+{
+    int head_len,
+        tail_len;
+
+    head_len = tree->head ? tree->head->length : 0;
+    tail_len = tree->tail ? tree->tail->length : 0;
+    expect(tree->head == NULL || head_len > 0, "empty head", test, step);
+    expect(tree->tail == NULL || tail_len > 0, "empty tail", test, step);
+    if (tree->root == NULL)
+    {
+        expect(tree->height == 0 && head_len + tail_len == tree->length,
+               "items outside the trie", test, step);
+        return;
+    }
+
+    expect(tree->height == 0 || ((Branch *)tree->root)->length > 1,
+           "single slot root", test, step);
+    expect(check_node(tree->root, tree->height, compact, test, step)
+           == tree->length - head_len - tail_len, "trie size", test, step);
+}
+
+/*
+Check that `tree' holds the items of `model', read one at a time and through
+an iterator. The nodes of a mapped tree hold file offsets instead of
+pointers, so only its items are checked.
+*/
+
+void
+check_tree(Tree *tree, const Model *model, bool compact,
+           const char *test, int step)
+{
+    TreeIter iter;
+    const Elem *items;
+    int length,
+        index,
+        i;
+
+    expect(tree->length == model->length, "tree length", test, step);
+    if (tree->map == NULL)
+        check_trie(tree, compact, test, step);
+
+    for (i = 0; i < model->length; i++)
+        expect(TreeGet(tree, i) == model->items[i], "TreeGet", test, step);
+
+    index = 0;
+    TreeIterInit(&iter, tree);
+    while (TreeIterNext(&iter, &items, &length))
+    {
+        expect(index + length <= model->length, "iterator length", test, step);
+        for (i = 0; i < length; i++)
+            expect(items[i] == model->items[index + i], "iterator item",
+                   test, step);
+        index += length;
+    }
+    expect(index == model->length, "iterator end", test, step);
+}
+
+/*
+Check that every branch under `node' of `height' is flagged dense.
+*/
+
+void
+check_dense(void *node, int height, const char *test, int step)
+{
+    Branch *branch;
+    int i;
+
+    if (height == 0)
+        return;
+
+    branch = node;
+    expect(branch->dense, "dense branch", test, step);
+    for (i = 0; i < branch->length; i++)
+        check_dense(branch->slots[i], height - 1, test, step);
+}
+
+/*
+A tree of random pieces of up to `max_piece' items, concatenated and sliced,
+with a few items prepended so that it has a head. `model' is set to its
+items.
+*/
+
+Tree *
+relaxed_tree(Model *model, int max_piece)
+{
+    Tree *tree,
+         *piece,
+         *joined,
+         *sliced;
+    Elem value;
+    int from,
+        to,
+        i,
+        j;
+
+    tree = TreeNew();
+    model->length = 0;
+    for (i = rand_below(6); i >= 0; i--)
+    {
+        piece = TreeNew();
+        for (j = rand_below(max_piece); j > 0; j--)
+        {
+            TreePush(piece, (Elem)model->length);
+            model->items[model->length] = (Elem)model->length;
+            model->length++;
+        }
+        joined = TreeConcat(tree, piece);
+        TreeRelease(tree);
+        TreeRelease(piece);
+        tree = joined;
+    }
+
+    from = rand_below(model->length + 1);
+    to = from + rand_below(model->length - from + 1);
+    sliced = TreeSlice(tree, from, to);
+    TreeRelease(tree);
+    model_remove(model, to, model->length);
+    model_remove(model, 0, from);
+
+    for (i = rand_below(2 * LEAF_FACTOR); i > 0; i--)
+    {
+        value = (Elem)-i;
+        TreePrepend(sliced, value);
+        model_insert(model, 0, 1, &value);
+    }
+
+    return sliced;
+}
+
+/* TESTS */
+
+/*
+Pushes, prepends and pops from both ends, which go through the head and tail
+buffers. Popping everything has to shrink the trie back down to nothing.
+*/
+
+void
+test_deque(void)
+{
+    Model model;
+    Tree *tree;
+    Elem value;
+    int step,
+        op;
+
+    model.items = malloc(MAX_ITEMS * sizeof(Elem));
+    model.length = 0;
+    tree = TreeNew();
+    for (step = 0; step < 200000; step++)
+    {
+        op = rand_below(100);
+        value = (Elem)step;
+        if (op < 30 && model.length < MAX_ITEMS)
+        {
+            TreePush(tree, value);
+            model_insert(&model, model.length, 1, &value);
+        }
+        else if (op < 60 && model.length < MAX_ITEMS)
+        {
+            TreePrepend(tree, value);
+            model_insert(&model, 0, 1, &value);
+        }
+        else if (op < 75 && model.length)
+        {
+            expect(TreePop(tree) == model.items[model.length - 1],
+                   "TreePop", "deque", step);
+            model_remove(&model, model.length - 1, model.length);
+        }
+        else if (op < 90 && model.length)
+        {
+            expect(TreePopFront(tree) == model.items[0],
+                   "TreePopFront", "deque", step);
+            model_remove(&model, 0, 1);
+        }
+        else if (model.length)
+        {
+            op = rand_below(model.length);
+            TreeSet(tree, op, value);
+            model.items[op] = value;
+        }
+        if (step % 997 == 0)
+            check_tree(tree, &model, false, "deque", step);
+    }
+
+    check_tree(tree, &model, false, "deque", step);
+    while (model.length)
+    {
+        if (model.length % 2)
+        {
+            expect(TreePop(tree) == model.items[model.length - 1],
+                   "TreePop", "deque", step);
+            model_remove(&model, model.length - 1, model.length);
+        }
+        else
+        {
+            expect(TreePopFront(tree) == model.items[0],
+                   "TreePopFront", "deque", step);
+            model_remove(&model, 0, 1);
+        }
+        if (model.length % 331 == 0)
+            check_tree(tree, &model, false, "deque", step);
+    }
+    expect(tree->root == NULL && tree->height == 0, "popped trie",
+           "deque", step);
+
+    TreeRelease(tree);
+    free(model.items);
+}
+
+/*
+Inserts and removes in the middle of trees built by pushing, with persistent
+snapshots taken along the way that must not see the later edits. Every
+branch has to stay within MAX_COMPACT throughout.
+*/
+
+void
+test_edit(void)
+{
+    Model model,
+          *snap_model;
+    Tree *tree,
+         *snap;
+    Elem arr[300];
+    int round,
+        step,
+        op,
+        from,
+        to,
+        len,
+        i;
+
+    model.items = malloc(MAX_ITEMS * sizeof(Elem));
+    snap = NULL;
+    snap_model = NULL;
+    for (round = 0; round < 40; round++)
+    {
+        tree = TreeNew();
+        model.length = rand_below(20000);
+        for (i = 0; i < model.length; i++)
+        {
+            model.items[i] = (Elem)i;
+            TreePush(tree, (Elem)i);
+        }
+
+        for (step = 0; step < 2000; step++)
+        {
+            op = rand_below(100);
+            if (op < 35)
+            {
+                from = rand_below(model.length + 1);
+                arr[0] = (Elem)rand_below(1000);
+                TreeInsertAt(tree, from, arr[0]);
+                model_insert(&model, from, 1, arr);
+            }
+            else if (op < 45)
+            {
+                from = rand_below(model.length + 1);
+                len = rand_below(rand_below(4) ? 5 : 300);
+                for (i = 0; i < len; i++)
+                    arr[i] = (Elem)rand_below(1000);
+                TreeInsertArrayAt(tree, from, len, arr);
+                model_insert(&model, from, len, arr);
+            }
+            else if (op < 80 && model.length)
+            {
+                from = rand_below(model.length);
+                expect(TreeRemoveAt(tree, from) == model.items[from],
+                       "TreeRemoveAt", "edit", step);
+                model_remove(&model, from, from + 1);
+            }
+            else if (op < 95 && model.length)
+            {
+                from = rand_below(model.length);
+                len = rand_below(4) ? 8 : 400;
+                to = from + rand_below(len);
+                if (to > model.length)
+                    to = model.length;
+                TreeRemoveRange(tree, from, to);
+                model_remove(&model, from, to);
+            }
+            else
+            {
+                if (snap)
+                {
+                    check_tree(snap, snap_model, false, "edit snapshot", step);
+                    TreeRelease(snap);
+                    model_free(snap_model);
+                }
+                snap = TreePersistent(TreeTransient(tree));
+                snap_model = model_copy(&model);
+            }
+            if (model.length > MAX_ITEMS - 1000)
+            {
+                TreeRemoveRange(tree, 0, model.length / 2);
+                model_remove(&model, 0, model.length / 2);
+            }
+            if (step % 97 == 0)
+                check_tree(tree, &model, true, "edit", step);
+        }
+
+        check_tree(tree, &model, true, "edit", step);
+        TreeRelease(tree);
+    }
+
+    if (snap)
+    {
+        check_tree(snap, snap_model, false, "edit snapshot", 0);
+        TreeRelease(snap);
+        model_free(snap_model);
+    }
+    free(model.items);
+}
+
+/*
+Pushes and sets of random items, single and by the array, which mostly go to
+the tail. Flushing the tail into the trie now and then leaves leafs short of
+full in the middle of the trie, which have to be found through the size
+tables.
+*/
+
+void
+test_push(void)
+{
+    Model model;
+    Tree *tree;
+    Elem arr[100];
+    int round,
+        step,
+        len,
+        i;
+
+    model.items = malloc(MAX_ITEMS * sizeof(Elem));
+    for (round = 0; round < 20; round++)
+    {
+        tree = TreeNew();
+        model.length = 0;
+        for (step = 0; step < 4000; step++)
+        {
+            if (rand_below(10) == 0)
+            {
+                len = rand_below(100);
+                for (i = 0; i < len; i++)
+                    arr[i] = (Elem)rand_below(1000);
+                TreePushArray(tree, len, arr);
+                model_insert(&model, model.length, len, arr);
+            }
+            else if (rand_below(50) == 0)
+                TreeFlushTail(tree);
+            else if (rand_below(2) && model.length)
+            {
+                i = rand_below(model.length);
+                model.items[i] = (Elem)rand_below(1000);
+                TreeSet(tree, i, model.items[i]);
+            }
+            else
+            {
+                arr[0] = (Elem)rand_below(1000);
+                TreePush(tree, arr[0]);
+                model_insert(&model, model.length, 1, arr);
+            }
+            if (step % 97 == 0)
+                check_tree(tree, &model, false, "push", step);
+        }
+
+        check_tree(tree, &model, false, "push", round);
+        TreeFlushTail(tree);
+        expect(tree->tail == NULL, "flushed tail", "push", round);
+        check_tree(tree, &model, false, "push flushed", round);
+        TreeRelease(tree);
+    }
+
+    free(model.items);
+}
+
+/*
+Versions derived from each other by TreeAssoc and TreeConj, each kept along
+with a copy of the model. Deriving a version may not change the one it came
+from, nor any other version sharing nodes with it, and neither may releasing
+the version it replaces.
+*/
+
+#define VERSIONS 8
+
+void
+test_persistent(void)
+{
+    Model *models[VERSIONS];
+    Tree *versions[VERSIONS];
+    Tree *next;
+    Elem value;
+    int step,
+        from,
+        to,
+        index,
+        i;
+
+    models[0] = malloc(sizeof(Model));
+    models[0]->items = malloc(MAX_ITEMS * sizeof(Elem));
+    models[0]->length = 0;
+    for (i = 0; i < VERSIONS; i++)
+    {
+        if (i > 0)
+            models[i] = model_copy(models[0]);
+        versions[i] = TreePersistent(TreeNew());
+    }
+
+    for (step = 0; step < 20000; step++)
+    {
+        from = rand_below(VERSIONS);
+        to = rand_below(VERSIONS);
+        value = (Elem)rand_below(1000);
+        index = -1;
+        if (rand_below(3) && models[from]->length < MAX_ITEMS)
+            next = TreeConj(versions[from], value);
+        else if (models[from]->length)
+        {
+            index = rand_below(models[from]->length);
+            next = TreeAssoc(versions[from], index, value);
+        }
+        else
+            continue;
+
+        if (to != from)
+        {
+            memcpy(models[to]->items, models[from]->items,
+                   models[from]->length * sizeof(Elem));
+            models[to]->length = models[from]->length;
+        }
+        if (index < 0)
+            model_insert(models[to], models[to]->length, 1, &value);
+        else
+            models[to]->items[index] = value;
+        TreeRelease(versions[to]);
+        versions[to] = next;
+
+        if (step % 499 == 0)
+            for (i = 0; i < VERSIONS; i++)
+                check_tree(versions[i], models[i], true, "persistent", step);
+    }
+
+    for (i = 0; i < VERSIONS; i++)
+    {
+        check_tree(versions[i], models[i], true, "persistent", step);
+        TreeRelease(versions[i]);
+        model_free(models[i]);
+    }
+}
+
+#undef VERSIONS
+
+/*
+Batches of pushes and sets on transients of a persistent tree, which update
+the nodes they own in place. The persistent tree the batch started from, and
+the one it ended as, may not see the updates of later batches. Built by
+pushing alone, the tree is dense throughout.
+*/
+
+void
+test_transient(void)
+{
+    Model model,
+          *snap_model;
+    Tree *tree,
+         *snap;
+    Elem value;
+    int round,
+        step,
+        i;
+
+    model.items = malloc(MAX_ITEMS * sizeof(Elem));
+    model.length = 0;
+    snap = TreePersistent(TreeNew());
+    snap_model = model_copy(&model);
+    for (round = 0; round < 30; round++)
+    {
+        tree = TreeTransient(snap);
+        for (step = 0; step < 2000; step++)
+        {
+            value = (Elem)rand_below(1000);
+            if (rand_below(2) && model.length)
+            {
+                i = rand_below(model.length);
+                TreeSet(tree, i, value);
+                model.items[i] = value;
+            }
+            else
+            {
+                TreePush(tree, value);
+                model_insert(&model, model.length, 1, &value);
+            }
+        }
+
+        check_tree(tree, &model, true, "transient", round);
+        if (tree->root)
+            check_dense(tree->root, tree->height, "transient", round);
+        check_tree(snap, snap_model, true, "transient snapshot", round);
+        TreeRelease(snap);
+        snap = TreePersistent(tree);
+        model_free(snap_model);
+        snap_model = model_copy(&model);
+    }
+
+    check_tree(snap, snap_model, true, "transient snapshot", round);
+    TreeRelease(snap);
+    model_free(snap_model);
+    free(model.items);
+}
+
+/*
+Trees built in an arena and dropped all at once with it, in between updates
+of a tree built from the slabs, which has to keep its items throughout. Every
+other arena tree is released after switching back to the slabs, along with a
+slab copy sharing its nodes: the arena's nodes must go back to the arena, not
+onto a slab free list that hands them out again after ArenaFree.
+*/
+
+void
+test_allocator(void)
+{
+    Model model,
+          arena_model;
+    Allocator *arena;
+    Tree *tree,
+         *arena_tree,
+         *copy;
+    Elem value;
+    int round,
+        i;
+
+    model.items = malloc(MAX_ITEMS * sizeof(Elem));
+    arena_model.items = malloc(MAX_ITEMS * sizeof(Elem));
+    model.length = 0;
+    tree = TreeNew();
+    for (round = 0; round < 20; round++)
+    {
+        arena = ArenaNew();
+        AllocatorUse(arena);
+        arena_tree = TreeNew();
+        arena_model.length = 0;
+        for (i = 0; i < 5000; i++)
+        {
+            value = (Elem)(round + i);
+            TreePush(arena_tree, value);
+            model_insert(&arena_model, arena_model.length, 1, &value);
+        }
+        AllocatorUse(&SlabAllocator);
+
+        for (i = 0; i < 1000; i++)
+        {
+            value = (Elem)rand_below(1000);
+            TreePush(tree, value);
+            model_insert(&model, model.length, 1, &value);
+        }
+        check_tree(arena_tree, &arena_model, true, "allocator arena", round);
+        if (round % 2)
+        {
+            arena_tree = TreePersistent(arena_tree);
+            copy = TreeAssoc(arena_tree, rand_below(5000), (Elem)-1);
+            TreeRelease(copy);
+            TreeRelease(arena_tree);
+        }
+        ArenaFree(arena);
+
+        for (i = 0; i < 1000; i++)
+        {
+            value = (Elem)rand_below(1000);
+            TreePush(tree, value);
+            model_insert(&model, model.length, 1, &value);
+        }
+        check_tree(tree, &model, true, "allocator", round);
+    }
+
+    TreeRelease(tree);
+    free(model.items);
+    free(arena_model.items);
+}
+
+/*
+Concatenations of trees of random sizes, which exercises the rebalancing of
+the seams between trees of different heights. The joined trees have to be
+left as they were, also by sets on the result, which shares their full nodes.
+*/
+
+void
+test_concat(void)
+{
+    Model model,
+          part;
+    Tree *tree,
+         *piece,
+         *joined;
+    int sets[8],
+        round,
+        i,
+        j;
+
+    model.items = malloc(MAX_ITEMS * sizeof(Elem));
+    part.items = malloc(MAX_ITEMS * sizeof(Elem));
+    for (round = 0; round < 300; round++)
+    {
+        tree = TreeNew();
+        model.length = 0;
+        for (i = rand_below(6); i >= 0; i--)
+        {
+            piece = TreeNew();
+            part.length = 0;
+            for (j = rand_below(rand_below(2) ? 50 : 5000); j > 0; j--)
+            {
+                TreePush(piece, (Elem)(model.length + part.length));
+                part.items[part.length] = (Elem)(model.length + part.length);
+                part.length++;
+            }
+            joined = TreeConcat(tree, piece);
+            for (j = 0; j < 8; j++)
+            {
+                sets[j] = rand_below(model.length + part.length + 1) - 1;
+                if (sets[j] >= 0)
+                    TreeSet(joined, sets[j], (Elem)-1);
+            }
+            check_tree(tree, &model, false, "concat left", round);
+            check_tree(piece, &part, true, "concat right", round);
+            TreeRelease(tree);
+            TreeRelease(piece);
+            tree = joined;
+            model_insert(&model, model.length, part.length, part.items);
+            for (j = 0; j < 8; j++)
+                if (sets[j] >= 0)
+                    model.items[sets[j]] = (Elem)-1;
+        }
+
+        check_tree(tree, &model, false, "concat", round);
+        TreeRelease(tree);
+    }
+
+    free(model.items);
+    free(part.items);
+}
+
+/*
+Slices, takes, drops and splits at random points of trees concatenated and
+sliced before. The tree they are cut from has to be left as it was. The head
+and tail buffers a take or drop copies belong to the result, so that it can
+push and prepend into them in place.
+*/
+
+void
+test_slice(void)
+{
+    Model model,
+          part;
+    Tree *tree,
+         *left,
+         *right;
+    int head_len,
+        tail_len,
+        round,
+        from,
+        to;
+
+    model.items = malloc(MAX_ITEMS * sizeof(Elem));
+    part.items = malloc(MAX_ITEMS * sizeof(Elem));
+    for (round = 0; round < 400; round++)
+    {
+        tree = relaxed_tree(&model, rand_below(2) ? 50 : 5000);
+        check_tree(tree, &model, false, "slice", round);
+
+        from = rand_below(model.length + 1);
+        to = from + rand_below(model.length - from + 1);
+        switch (round % 4)
+        {
+        case 0:
+            left = TreeSlice(tree, from, to);
+            break;
+        case 1:
+            left = TreeTake(tree, to);
+            from = 0;
+            break;
+        case 2:
+            left = TreeDrop(tree, from);
+            to = model.length;
+            break;
+        default:
+            TreeSplitAt(tree, from, &left, &right);
+            part.length = model.length - from;
+            memcpy(part.items, model.items + from, part.length * sizeof(Elem));
+            check_tree(right, &part, false, "split right", round);
+            TreeRelease(right);
+            to = from;
+            from = 0;
+            break;
+        }
+
+        head_len = tree->head ? tree->head->length : 0;
+        tail_len = tree->tail ? tree->tail->length : 0;
+        if (round % 4 == 1 && to > 0
+            && (to <= head_len || to > model.length - tail_len))
+            expect(left->tail == tree->tail || left->tail->edit == left->edit,
+                   "tail edit", "take", round);
+        if (round % 4 == 2 && from < head_len)
+            expect(left->head->edit == left->edit, "head edit", "drop", round);
+        if (round % 4 == 2 && from >= model.length - tail_len && to > from)
+            expect(left->tail == tree->tail || left->tail->edit == left->edit,
+                   "tail edit", "drop", round);
+
+        part.length = to - from;
+        memcpy(part.items, model.items + from, part.length * sizeof(Elem));
+        check_tree(left, &part, false, "slice part", round);
+        check_tree(tree, &model, false, "sliced", round);
+        TreeRelease(left);
+        TreeRelease(tree);
+    }
+
+    free(model.items);
+    free(part.items);
+}
+
+/*
+Lookups in a tree taller than the unrolled part of the walk, with the smaller
+factors, pushed and then relaxed by cutting a few items off its front. The
+items are their indices, so no model is needed.
+*/
+
+void
+test_tall(void)
+{
+    Tree *tree,
+         *dropped;
+    int length,
+        step,
+        i;
+
+    length = 1 << 21;
+    tree = TreeNew();
+    for (i = 0; i < length; i++)
+        TreePush(tree, (Elem)i);
+    dropped = TreeDrop(tree, 3);
+
+    check_trie(tree, false, "tall", 0);
+    check_trie(dropped, false, "tall dropped", 0);
+    for (step = 0; step < 100000; step++)
+    {
+        i = rand_below(length - 3);
+        expect(TreeGet(tree, i) == i, "TreeGet", "tall", step);
+        expect(TreeGet(dropped, i) == i + 3, "TreeGet", "tall dropped", step);
+    }
+
+    TreeRelease(dropped);
+    TreeRelease(tree);
+}
+
+/*
+Trees built bottom-up from lengths around the sizes of a leaf and of full
+branches of every height that fits, by TreeFromArray and by a builder fed a
+mix of single items and arrays, against trees built by pushing the same
+items. Both have to be dense throughout, and take further pushes.
+*/
+
+void
+check_built(Tree *tree, Tree *pushed, Model *model, int step)
+{
+    Elem value;
+    int i;
+
+    check_tree(tree, model, true, "build", step);
+    if (tree->root)
+        check_dense(tree->root, tree->height, "build", step);
+    expect(tree->height == pushed->height, "height of pushed", "build", step);
+
+    for (i = 0; i < LEAF_FACTOR * BRANCH_FACTOR + 3; i++)
+    {
+        value = (Elem)-i;
+        TreePush(tree, value);
+        model_insert(model, model->length, 1, &value);
+    }
+    check_tree(tree, model, true, "build push", step);
+}
+
+void
+test_build(void)
+{
+    Model model;
+    TreeBuilder builder;
+    Tree *pushed,
+         *tree;
+    long long size;
+    int lengths[64],
+        count,
+        length,
+        step,
+        n,
+        i;
+
+    count = 0;
+    lengths[count++] = 0;
+    lengths[count++] = 1;
+    for (size = LEAF_FACTOR; size + 1 < MAX_ITEMS / 2; size *= BRANCH_FACTOR)
+    {
+        lengths[count++] = size - 1;
+        lengths[count++] = size;
+        lengths[count++] = size + 1;
+    }
+
+    model.items = malloc(MAX_ITEMS * sizeof(Elem));
+    for (step = 0; step < count; step++)
+    {
+        length = lengths[step];
+        pushed = TreeNew();
+        for (i = 0; i < length; i++)
+            TreePush(pushed, (Elem)i);
+
+        model.length = length;
+        for (i = 0; i < length; i++)
+            model.items[i] = (Elem)i;
+        tree = TreeFromArray(model.items, length);
+        check_built(tree, pushed, &model, step);
+        TreeRelease(tree);
+
+        model.length = length;
+        TreeBuilderInit(&builder);
+        for (i = 0; i < length; i += n)
+        {
+            n = rand_below(3) ? 1 : 1 + rand_below(3 * LEAF_FACTOR);
+            if (n > length - i)
+                n = length - i;
+            if (n == 1)
+                TreeBuilderPush(&builder, model.items[i]);
+            else
+                TreeBuilderPushArray(&builder, model.items + i, n);
+        }
+        tree = TreeBuilderFinish(&builder);
+        check_built(tree, pushed, &model, step);
+        TreeRelease(tree);
+        TreeRelease(pushed);
+    }
+
+    free(model.items);
+}
+
+/*
+Joins of up to 16 trees at once, among them empty trees, trees with only a
+head or a tail and relaxed ones, against folding TreeConcat over the same
+trees. The joined trees have to be left as they were.
+*/
+
+void
+test_concat_many(void)
+{
+    Model model,
+          part;
+    Tree *trees[16],
+         *many,
+         *folded,
+         *joined;
+    Elem value;
+    int starts[17],
+        round,
+        kind,
+        n,
+        i,
+        j;
+
+    model.items = malloc(MAX_ITEMS * sizeof(Elem));
+    part.items = malloc(MAX_ITEMS * sizeof(Elem));
+    for (round = 0; round < 300; round++)
+    {
+        n = rand_below(17);
+        model.length = 0;
+        for (i = 0; i < n; i++)
+        {
+            kind = rand_below(4);
+            if (kind == 3)
+                trees[i] = relaxed_tree(&part, 2000);
+            else
+            {
+                trees[i] = TreeNew();
+                part.length = 0;
+                for (j = kind ? rand_below(LEAF_FACTOR) + 1 : 0; j > 0; j--)
+                {
+                    value = (Elem)rand_below(1000);
+                    if (kind == 1)
+                        TreePrepend(trees[i], value);
+                    else
+                        TreePush(trees[i], value);
+                    model_insert(&part, kind == 1 ? 0 : part.length, 1,
+                                 &value);
+                }
+            }
+            starts[i] = model.length;
+            model_insert(&model, model.length, part.length, part.items);
+        }
+        starts[n] = model.length;
+
+        many = TreeConcatMany(trees, n);
+        check_tree(many, &model, false, "concat many", round);
+
+        folded = TreeNew();
+        for (i = 0; i < n; i++)
+        {
+            joined = TreeConcat(folded, trees[i]);
+            TreeRelease(folded);
+            folded = joined;
+        }
+        check_tree(folded, &model, false, "concat fold", round);
+        for (i = 0; i < model.length; i++)
+            expect(TreeGet(many, i) == TreeGet(folded, i), "same as fold",
+                   "concat many", round);
+
+        for (i = 0; i < n; i++)
+        {
+            part.length = starts[i + 1] - starts[i];
+            memcpy(part.items, model.items + starts[i],
+                   part.length * sizeof(Elem));
+            check_tree(trees[i], &part, false, "concat many input", round);
+            TreeRelease(trees[i]);
+        }
+        TreeRelease(many);
+        TreeRelease(folded);
+    }
+
+    free(model.items);
+    free(part.items);
+}
+
+/*
+The bulk operations over relaxed trees with a head and a tail, against loops
+over the model. Ranges are filled in trees sharing their nodes with a
+snapshot, which has to keep its items.
+*/
+
+bool
+above(Elem value, void *ctx)
+{
+    return value > *(Elem *)ctx;
+}
+
+void
+check_bulk(Tree *tree, const Model *model, int step)
+{
+    ElemSum sum;
+    Elem min,
+         max,
+         lo,
+         hi,
+         value;
+    int index,
+        count,
+        i;
+
+    sum = 0;
+    for (i = 0; i < model->length; i++)
+        sum += model->items[i];
+    expect(TreeSum(tree) == sum, "TreeSum", "bulk", step);
+
+    expect(TreeMinMax(tree, &min, &max) == (model->length > 0),
+           "TreeMinMax", "bulk", step);
+    if (model->length)
+    {
+        lo = hi = model->items[0];
+        for (i = 1; i < model->length; i++)
+        {
+            lo = model->items[i] < lo ? model->items[i] : lo;
+            hi = model->items[i] > hi ? model->items[i] : hi;
+        }
+        expect(min == lo && max == hi, "TreeMinMax", "bulk", step);
+    }
+
+    value = model->length ? model->items[rand_below(model->length)] : 0;
+    for (index = 0; index < model->length; index++)
+        if (model->items[index] == value)
+            break;
+    expect(TreeIndexOf(tree, value) == (index < model->length ? index : -1),
+           "TreeIndexOf", "bulk", step);
+    expect(TreeIndexOf(tree, (Elem)MAX_ITEMS) == -1, "TreeIndexOf absent",
+           "bulk", step);
+
+    for (index = 0; index < model->length; index++)
+        if (model->items[index] > value)
+            break;
+    count = 0;
+    for (i = 0; i < model->length; i++)
+        count += model->items[i] > value;
+    expect(TreeFind(tree, above, &value)
+           == (index < model->length ? index : -1), "TreeFind", "bulk", step);
+    expect(TreeCount(tree, above, &value) == count, "TreeCount", "bulk", step);
+
+    count = 0;
+    for (i = 0; i < model->length; i++)
+        count += model->items[i] == value;
+    expect(TreeCountEqual(tree, value) == count, "TreeCountEqual", "bulk",
+           step);
+
+    for (index = 0; index < model->length; index++)
+        if (model->items[index] < value)
+            break;
+    count = 0;
+    for (i = 0; i < model->length; i++)
+        count += model->items[i] < value;
+    expect(TreeFindLess(tree, value) == (index < model->length ? index : -1),
+           "TreeFindLess", "bulk", step);
+    expect(TreeCountLess(tree, value) == count, "TreeCountLess", "bulk", step);
+
+    lo = value;
+    hi = model->length ? model->items[rand_below(model->length)] : 0;
+    if (hi < lo)
+    {
+        lo = hi;
+        hi = value;
+    }
+    for (index = 0; index < model->length; index++)
+        if (model->items[index] >= lo && model->items[index] <= hi)
+            break;
+    count = 0;
+    for (i = 0; i < model->length; i++)
+        count += model->items[i] >= lo && model->items[i] <= hi;
+    expect(TreeFindBetween(tree, lo, hi)
+           == (index < model->length ? index : -1), "TreeFindBetween", "bulk",
+           step);
+    expect(TreeCountBetween(tree, lo, hi) == count, "TreeCountBetween",
+           "bulk", step);
+    expect(TreeFindBetween(tree, hi, lo) == (lo == hi ? index : -1),
+           "TreeFindBetween empty", "bulk", step);
+}
+
+void
+test_bulk(void)
+{
+    Model model,
+          *snap_model;
+    Tree *tree,
+         *snap;
+    Elem value;
+    int round,
+        from,
+        to,
+        i;
+
+    model.items = malloc(MAX_ITEMS * sizeof(Elem));
+    for (round = 0; round < 200; round++)
+    {
+        tree = relaxed_tree(&model, rand_below(2) ? 50 : 5000);
+        for (i = rand_below(LEAF_FACTOR); i > 0; i--)
+        {
+            value = (Elem)model.length;
+            TreePush(tree, value);
+            model_insert(&model, model.length, 1, &value);
+        }
+        check_bulk(tree, &model, round);
+
+        snap = TreePersistent(TreeTransient(tree));
+        snap_model = model_copy(&model);
+        for (i = 0; i < 8; i++)
+        {
+            from = rand_below(model.length + 1);
+            to = from + rand_below(model.length - from + 1);
+            value = (Elem)rand_below(1000);
+            TreeFillRange(tree, from, to, value);
+            for (; from < to; from++)
+                model.items[from] = value;
+            check_bulk(tree, &model, round);
+        }
+
+        check_tree(tree, &model, false, "bulk fill", round);
+        check_tree(snap, snap_model, false, "bulk snapshot", round);
+        TreeRelease(snap);
+        model_free(snap_model);
+        TreeRelease(tree);
+    }
+
+    free(model.items);
+}
+
+/*
+The parallel reduce and map over relaxed trees of a few chunks each, joined
+from smaller relaxed trees, on pools of one to four threads.
+*/
+
+void
+sum_reduce(void *acc, const Elem *items, int length, void *ctx)
+{
+    int i;
+
+    (void)ctx;
+    for (i = 0; i < length; i++)
+        *(ElemSum *)acc += items[i];
+}
+
+void
+sum_combine(void *acc, const void *part, void *ctx)
+{
+    (void)ctx;
+    *(ElemSum *)acc += *(const ElemSum *)part;
+}
+
+Elem
+negate(Elem value, void *ctx)
+{
+    (void)ctx;
+    return -value;
+}
+
+/*
+Check the parallel operations against the model, they walk the trie on their
+own instead of through TreeGet.
+*/
+
+void
+check_parallel(Tree *tree, TaskPool *pool, Model *model,
+               const char *test, int step)
+{
+    Tree *mapped;
+    ElemSum sum,
+            expected;
+    int i;
+
+    expected = 0;
+    for (i = 0; i < model->length; i++)
+        expected += model->items[i];
+    sum = 0;
+    TreeParallelReduce(tree, pool, &sum, sizeof(sum),
+                       sum_reduce, sum_combine, NULL);
+    expect(sum == expected, "TreeParallelReduce", test, step);
+
+    mapped = TreeParallelMap(tree, pool, negate, NULL);
+    for (i = 0; i < model->length; i++)
+        model->items[i] = -model->items[i];
+    check_tree(mapped, model, false, test, step);
+    for (i = 0; i < model->length; i++)
+        model->items[i] = -model->items[i];
+    TreeRelease(mapped);
+}
+
+void
+test_parallel(void)
+{
+    Model model,
+          part;
+    TaskPool *pool;
+    Tree *tree,
+         *piece,
+         *joined;
+    Elem value;
+    int round,
+        i;
+
+    model.items = malloc(MAX_ITEMS * sizeof(Elem));
+    part.items = malloc(MAX_ITEMS * sizeof(Elem));
+    for (round = 0; round < 12; round++)
+    {
+        pool = TaskPoolNew(1 + round % 4);
+        tree = relaxed_tree(&model, 5000);
+        while (model.length + 7 * 5000 < MAX_ITEMS)
+        {
+            piece = relaxed_tree(&part, 5000);
+            joined = TreeConcat(tree, piece);
+            TreeRelease(tree);
+            TreeRelease(piece);
+            tree = joined;
+            model_insert(&model, model.length, part.length, part.items);
+        }
+        for (i = rand_below(LEAF_FACTOR); i > 0; i--)
+        {
+            value = (Elem)model.length;
+            TreePush(tree, value);
+            model_insert(&model, model.length, 1, &value);
+        }
+
+        check_parallel(tree, pool, &model, "parallel", round);
+        TreeRelease(tree);
+        TaskPoolFree(pool);
+    }
+
+    free(model.items);
+    free(part.items);
+}
+
+/*
+Batches of tasks of uneven cost, from none up to many more than threads, run
+on one pool. The queues are taken from and stolen from without locks, and
+every task still has to run exactly once.
+*/
+
+void
+count_task(void *arg, int task)
+{
+    int *runs,
+        spin,
+        i;
+
+    runs = arg;
+    spin = 0;
+    for (i = 0; i < (task % 7) * 1000; i++)
+        spin += i;
+    __atomic_add_fetch(&runs[task], spin >= 0, __ATOMIC_RELAXED);
+}
+
+void
+test_task_pool(void)
+{
+    TaskPool *pool;
+    int *runs,
+        round,
+        tasks,
+        i;
+
+    pool = TaskPoolNew(4);
+    runs = malloc(10000 * sizeof(int));
+    for (round = 0; round < 500; round++)
+    {
+        tasks = round % 10 == 0 ? rand_below(8) : rand_below(10000);
+        memset(runs, 0, tasks * sizeof(int));
+        TaskPoolRun(pool, tasks, count_task, runs);
+        for (i = 0; i < tasks && runs[i] == 1; i++)
+            ;
+        expect(i == tasks, "TaskPoolRun", "task pool", round);
+    }
+
+    free(runs);
+    TaskPoolFree(pool);
+}
+
+/*
+Trees mapped by the threads of a pool and released by the caller, over and
+over, with a new pool every round. The nodes come back to the slabs however
+many threads freed them or exited holding them, so the resident size stays
+flat.
+*/
+
+long
+resident_size(void)
+{
+    FILE *file;
+    long pages;
+
+    file = fopen("/proc/self/statm", "r");
+    if (file == NULL)
+        return -1;
+    if (fscanf(file, "%*s %ld", &pages) != 1)
+        pages = -1;
+    fclose(file);
+
+    return pages < 0 ? -1 : pages * sysconf(_SC_PAGESIZE);
+}
+
+void
+test_pool(void)
+{
+    TaskPool *pool;
+    Tree *tree,
+         *mapped;
+    long warm,
+         rss;
+    int round,
+        i;
+
+    tree = TreeNew();
+    for (i = 0; i < 1000000; i++)
+        TreePush(tree, (Elem)i);
+    tree = TreePersistent(tree);
+
+    warm = -1;
+    for (round = 0; round < 40; round++)
+    {
+        pool = TaskPoolNew(4);
+        mapped = TreeParallelMap(tree, pool, negate, NULL);
+        expect(TreeGet(mapped, round) == -round, "TreeParallelMap",
+               "pool", round);
+        TreeRelease(mapped);
+        TaskPoolFree(pool);
+        if (round == 4)
+            warm = resident_size();
+    }
+    rss = resident_size();
+    if (warm >= 0 && rss >= 0)
+        expect(rss - warm < 8 * 1024 * 1024, "resident size", "pool", round);
+
+    TreeRelease(tree);
+}
+
+/*
+Trees left relaxed by concatenating and slicing, compacted a few leafs at a
+time. The items may not change on the way, and once TreeCompact is done every
+branch has to be dense and within MAX_COMPACT. A snapshot sharing the nodes
+may not see any writes, not even to the dense flags, which readers on other
+threads would race with.
+*/
+
+int
+count_dense(void *node, int height)
+{
+    Branch *branch;
+    int count,
+        i;
+
+    if (height == 0)
+        return 0;
+
+    branch = node;
+    count = branch->dense;
+    for (i = 0; i < branch->length; i++)
+        count += count_dense(branch->slots[i], height - 1);
+
+    return count;
+}
+
+void
+test_compact(void)
+{
+    Model model;
+    Tree *tree,
+         *snap;
+    int dense,
+        round,
+        step;
+
+    model.items = malloc(MAX_ITEMS * sizeof(Elem));
+    for (round = 0; round < 200; round++)
+    {
+        tree = relaxed_tree(&model, rand_below(2) ? 50 : 5000);
+        snap = TreePersistent(TreeTransient(tree));
+        dense = snap->root ? count_dense(snap->root, snap->height) : 0;
+        for (step = 0; !TreeCompact(tree, 1 + rand_below(8)); step++)
+        {
+            expect(step <= model.length, "TreeCompact ends", "compact", round);
+            if (step % 13 == 0)
+                check_tree(tree, &model, false, "compact", round);
+        }
+
+        check_tree(tree, &model, true, "compact", round);
+        if (tree->root)
+            check_dense(tree->root, tree->height, "compact", round);
+        check_tree(snap, &model, false, "compact snapshot", round);
+        expect(dense == (snap->root ? count_dense(snap->root, snap->height)
+                                    : 0), "snapshot flags", "compact", round);
+        TreeRelease(snap);
+        TreeRelease(tree);
+    }
+
+    free(model.items);
+}
+
+/*
+Successive versions written to a store and mapped back in.
+*/
+
+long
+file_size(const char *path)
+{
+    FILE *file;
+    long size;
+
+    file = fopen(path, "rb");
+    expect(file != NULL, "fopen", "store", 0);
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fclose(file);
+
+    return size;
+}
+
+/*
+Write versions of a tree each differing in one item, reopening the store in
+between now and then. Every version after the first may only append the path
+to the item it changed, with some slack for the padding and the root record.
+Then write a new tree under a file size limit that cuts it short, which has
+to leave the last version in place, and again once the limit is lifted.
+*/
+
+void
+test_store(void)
+{
+    Model model;
+    TreeStore *store;
+    TaskPool *pool;
+    Tree *tree,
+         *next,
+         *mapped;
+    struct rlimit limit,
+                  cut;
+    char path[] = "/tmp/rrbt_test_XXXXXX";
+    long size,
+         path_size;
+    int fd,
+        version,
+        index,
+        i;
+
+    fd = mkstemp(path);
+    expect(fd >= 0, "mkstemp", "store", 0);
+    close(fd);
+
+    model.items = malloc(MAX_ITEMS * sizeof(Elem));
+    model.length = 200000;
+    tree = TreeNew();
+    for (i = 0; i < model.length; i++)
+    {
+        model.items[i] = (Elem)i;
+        TreePush(tree, (Elem)i);
+    }
+    TreePersistent(tree);
+
+    pool = TaskPoolNew(4);
+    store = TreeStoreOpen(path);
+    expect(store != NULL, "TreeStoreOpen", "store", 0);
+    for (version = 0; version < 5; version++)
+    {
+        if (version % 2 == 0 && version > 0)
+        {
+            TreeStoreClose(store);
+            store = TreeStoreOpen(path);
+            expect(store != NULL, "TreeStoreOpen", "store", version);
+        }
+
+        size = file_size(path);
+        expect(TreeStoreWrite(store, tree), "TreeStoreWrite", "store",
+               version);
+        path_size = (tree->height + 2) * (sizeof(Branch) + 64)
+                    + 2 * (sizeof(Leaf) + 64);
+        expect(version == 0 || file_size(path) - size <= path_size,
+               "only the changed path appended", "store", version);
+        mapped = version % 2 ? TreeOpenMapped(path)
+                             : TreeOpenMappedChecked(path);
+        expect(mapped != NULL, "TreeOpenMapped", "store", version);
+        check_tree(mapped, &model, false, "store", version);
+        check_parallel(mapped, pool, &model, "store", version);
+        TreeRelease(mapped);
+
+        index = rand_below(model.length);
+        next = TreeAssoc(tree, index, (Elem)-version);
+        model.items[index] = (Elem)-version;
+        TreeRelease(tree);
+        tree = next;
+    }
+
+    expect(TreeStoreWrite(store, tree), "TreeStoreWrite", "store", version);
+    next = TreeNew();
+    for (i = 0; i < model.length; i++)
+        TreePush(next, (Elem)(3 * i + 1));
+    TreePersistent(next);
+
+    signal(SIGXFSZ, SIG_IGN);
+    expect(getrlimit(RLIMIT_FSIZE, &limit) == 0, "getrlimit", "store", 0);
+    cut = limit;
+    cut.rlim_cur = file_size(path) + model.length * sizeof(Elem) / 2;
+    expect(setrlimit(RLIMIT_FSIZE, &cut) == 0, "setrlimit", "store", 0);
+    expect(!TreeStoreWrite(store, next), "cut short", "store", version);
+    expect(setrlimit(RLIMIT_FSIZE, &limit) == 0, "setrlimit", "store", 0);
+    signal(SIGXFSZ, SIG_DFL);
+
+    mapped = TreeOpenMapped(path);
+    expect(mapped != NULL, "TreeOpenMapped", "store", version);
+    check_tree(mapped, &model, false, "store", version);
+    TreeRelease(mapped);
+
+    expect(TreeStoreWrite(store, next), "TreeStoreWrite", "store", version);
+    for (i = 0; i < model.length; i++)
+        model.items[i] = (Elem)(3 * i + 1);
+    mapped = TreeOpenMapped(path);
+    expect(mapped != NULL, "TreeOpenMapped", "store", version);
+    check_tree(mapped, &model, false, "store", version);
+    TreeRelease(mapped);
+    TreeRelease(next);
+
+    TreeStoreClose(store);
+    TaskPoolFree(pool);
+    TreeRelease(tree);
+    unlink(path);
+    free(model.items);
+}
+
+void
+write_file(const char *path, const char *data, long size)
+{
+    FILE *file;
+
+    file = fopen(path, "wb");
+    expect(file != NULL && fwrite(data, 1, size, file) == (size_t)size
+           && fclose(file) == 0, "write_file", "corrupt", 0);
+}
+
+/*
+Store a small tree, then map copies of the file cut short or with a byte
+changed. TreeOpenMappedChecked has to refuse the copy, or return a tree that
+can be read through without leaving the mapping.
+*/
+
+void
+test_corrupt(void)
+{
+    Tree *tree,
+         *mapped;
+    TreeStore *store;
+    FILE *file;
+    char *data,
+         *copy;
+    char path[] = "/tmp/rrbt_test_XXXXXX";
+    long size;
+    int fd,
+        step,
+        i;
+
+    fd = mkstemp(path);
+    expect(fd >= 0, "mkstemp", "corrupt", 0);
+    close(fd);
+
+    tree = TreeNew();
+    for (i = 0; i < 5000; i++)
+        TreePush(tree, (Elem)i);
+    TreePersistent(tree);
+    store = TreeStoreOpen(path);
+    expect(store != NULL && TreeStoreWrite(store, tree), "TreeStoreWrite",
+           "corrupt", 0);
+    TreeStoreClose(store);
+    TreeRelease(tree);
+
+    file = fopen(path, "rb");
+    expect(file != NULL, "fopen", "corrupt", 0);
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    rewind(file);
+    data = malloc(size);
+    copy = malloc(size);
+    expect(fread(data, 1, size, file) == (size_t)size, "fread", "corrupt", 0);
+    fclose(file);
+
+    for (step = 0; step < 2000; step++)
+    {
+        memcpy(copy, data, size);
+        if (step % 10 == 0)
+            write_file(path, copy, rand_below(size));
+        else
+        {
+            copy[rand_below(size)] = (char)rand_below(256);
+            write_file(path, copy, size);
+        }
+
+        mapped = TreeOpenMappedChecked(path);
+        if (mapped == NULL)
+            continue;
+        for (i = 0; i < mapped->length; i++)
+            TreeGet(mapped, i);
+        TreeSum(mapped);
+        TreeRelease(mapped);
+    }
+
+    unlink(path);
+    free(copy);
+    free(data);
+}
+
+/*
+Versions published to a cell, read back through a reader on the writer's
+thread, and through readers on threads of their own, which have to see every
+version whole and no older than the last one they saw.
+*/
+
+void *
+cell_reader(void *arg)
+{
+    TreeReader *reader;
+    Tree *tree;
+    int length,
+        seen,
+        i;
+
+    reader = TreeReaderNew(arg);
+    seen = 0;
+    while (seen < 2000)
+    {
+        tree = TreeReaderPin(reader);
+        length = tree->length;
+        expect(length >= seen, "newer version", "cell reader", seen);
+        for (i = 0; i < 8 && length; i++)
+            expect(TreeGet(tree, length - 1 - i * length / 8)
+                   == (Elem)(length - 1 - i * length / 8), "TreeGet",
+                   "cell reader", length);
+        TreeReaderUnpin(reader);
+        seen = length;
+    }
+    TreeReaderFree(reader);
+
+    return NULL;
+}
+
+void
+test_cell(void)
+{
+    Model model;
+    TreeCell *cell;
+    TreeReader *reader;
+    Tree *tree,
+         *next;
+    pthread_t threads[2];
+    int step,
+        i;
+
+    model.items = malloc(MAX_ITEMS * sizeof(Elem));
+    model.length = 0;
+    cell = TreeCellNew(TreePersistent(TreeNew()));
+    reader = TreeReaderNew(cell);
+    for (i = 0; i < 2; i++)
+        pthread_create(&threads[i], NULL, cell_reader, cell);
+    for (step = 0; step < 2000; step++)
+    {
+        next = TreeConj(TreeCellGet(cell), (Elem)step);
+        TreeCellPublish(cell, next);
+        model.items[model.length++] = (Elem)step;
+
+        tree = TreeReaderPin(reader);
+        if (step % 101 == 0)
+            check_tree(tree, &model, false, "cell", step);
+        TreeReaderUnpin(reader);
+    }
+    for (i = 0; i < 2; i++)
+        pthread_join(threads[i], NULL);
+
+    TreeReaderFree(reader);
+    TreeCellFree(cell);
+    free(model.items);
+}
+
+/*
+Gets and sets on transients of relaxed trees, at random and walking up and
+down from a random index, so that the focus moves within a leaf and between
+leafs, with pushes in between that change the shape of the trie. A snapshot
+taken before every batch shares the focused path, and may not see the sets.
+Made persistent, the snapshot gives its focus back.
+*/
+
+void
+test_focus(void)
+{
+    Model model,
+          *snap_model;
+    Tree *tree,
+         *snap;
+    Elem value;
+    int round,
+        batch,
+        step,
+        index;
+
+    model.items = malloc(MAX_ITEMS * sizeof(Elem));
+    for (round = 0; round < 100; round++)
+    {
+        tree = relaxed_tree(&model, rand_below(2) ? 50 : 5000);
+        for (batch = 0; batch < 4; batch++)
+        {
+            snap = TreePersistent(tree);
+            expect(snap->focus == NULL, "persistent focus", "focus", round);
+            snap_model = model_copy(&model);
+            tree = TreeTransient(snap);
+
+            index = rand_below(model.length + 1);
+            for (step = 0; step < 500; step++)
+            {
+                if (rand_below(50) == 0)
+                {
+                    value = (Elem)rand_below(1000);
+                    TreePush(tree, value);
+                    model_insert(&model, model.length, 1, &value);
+                }
+                if (model.length == 0)
+                    continue;
+
+                if (rand_below(8) == 0)
+                    index = rand_below(model.length);
+                else
+                    index += rand_below(2) ? 1 : -1;
+                index = index < 0 ? 0 : index;
+                index = index >= model.length ? model.length - 1 : index;
+                if (rand_below(3) == 0)
+                {
+                    value = (Elem)rand_below(1000);
+                    TreeSet(tree, index, value);
+                    model.items[index] = value;
+                }
+                expect(TreeGet(tree, index) == model.items[index], "TreeGet",
+                       "focus", step);
+            }
+
+            check_tree(tree, &model, false, "focus", round);
+            check_tree(snap, snap_model, false, "focus snapshot", round);
+            TreeRelease(snap);
+            model_free(snap_model);
+        }
+        TreeRelease(tree);
+    }
+
+    free(model.items);
+}
+
+/*
+Iterators over relaxed trees with a head and a tail, walked backwards from the
+end, and seeked to the edges of the head, the tail and the leafs in between,
+then walked a few leafs either way. Every run yielded has to hold the items
+of the model right before or after the cursor.
+*/
+
+void
+check_walk(TreeIter *iter, const Model *model, int index, bool forward,
+           int leafs, int step)
+{
+    const Elem *items;
+    int length,
+        i;
+
+    for (; leafs > 0; leafs--)
+    {
+        if (forward ? !TreeIterNext(iter, &items, &length)
+                    : !TreeIterPrev(iter, &items, &length))
+        {
+            expect(index == (forward ? model->length : 0), "iterator end",
+                   "iter", step);
+            return;
+        }
+
+        expect(length > 0 && length <= LEAF_FACTOR, "run length", "iter",
+               step);
+        if (!forward)
+            index -= length;
+        expect(index >= 0 && index + length <= model->length, "run bounds",
+               "iter", step);
+        for (i = 0; i < length; i++)
+            expect(items[i] == model->items[index + i], "run item", "iter",
+                   step);
+        if (forward)
+            index += length;
+        expect(iter->index == index, "iterator index", "iter", step);
+    }
+}
+
+void
+test_iter(void)
+{
+    Model model;
+    Tree *tree;
+    TreeIter iter;
+    const Elem *items;
+    int *starts,
+        points[8],
+        count,
+        length,
+        head_len,
+        tail_len,
+        round,
+        index,
+        i,
+        j;
+
+    model.items = malloc(MAX_ITEMS * sizeof(Elem));
+    starts = malloc((MAX_ITEMS + 1) * sizeof(int));
+    for (round = 0; round < 200; round++)
+    {
+        tree = relaxed_tree(&model, rand_below(2) ? 50 : 5000);
+        for (i = rand_below(LEAF_FACTOR); i > 0; i--)
+        {
+            TreePush(tree, (Elem)model.length);
+            model.items[model.length] = (Elem)model.length;
+            model.length++;
+        }
+
+        TreeIterInit(&iter, tree);
+        TreeIterSeek(&iter, model.length);
+        check_walk(&iter, &model, model.length, false, model.length + 1,
+                   round);
+
+        count = 0;
+        TreeIterInit(&iter, tree);
+        while (TreeIterNext(&iter, &items, &length))
+            starts[count++] = iter.index - length;
+        starts[count++] = model.length;
+
+        head_len = tree->head ? tree->head->length : 0;
+        tail_len = tree->tail ? tree->tail->length : 0;
+        points[0] = head_len;
+        points[1] = head_len + 1;
+        points[2] = head_len - 1;
+        points[3] = model.length - tail_len;
+        points[4] = model.length - tail_len + 1;
+        points[5] = model.length - tail_len - 1;
+        points[6] = 0;
+        points[7] = model.length;
+        for (i = 0; i < 8 + 16; i++)
+        {
+            if (i < 8)
+                index = points[i];
+            else
+                index = starts[rand_below(count)] + rand_below(2);
+            if (index < 0 || index > model.length)
+                continue;
+
+            for (j = 0; j < 2; j++)
+            {
+                TreeIterInit(&iter, tree);
+                TreeIterSeek(&iter, index);
+                check_walk(&iter, &model, index, j, 3, round);
+                TreeIterSeek(&iter, index);
+                check_walk(&iter, &model, index, !j, 3, round);
+            }
+        }
+
+        TreeRelease(tree);
+    }
+
+    free(starts);
+    free(model.items);
+}
+
+int
+main(void)
+{
+    test_deque();
+    test_edit();
+    test_push();
+    test_persistent();
+    test_transient();
+    test_allocator();
+    test_concat();
+    test_slice();
+    test_tall();
+    test_iter();
+    test_build();
+    test_bulk();
+    test_parallel();
+    test_task_pool();
+    test_pool();
+    test_concat_many();
+    test_compact();
+    test_store();
+    test_corrupt();
+    test_cell();
+    test_focus();
+    printf("all tests passed (BRANCH_FACTOR=%d, LEAF_FACTOR=%d)\n",
+           BRANCH_FACTOR, LEAF_FACTOR);
+
+    return 0;
+}